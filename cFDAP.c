@@ -3,19 +3,38 @@
 /*******************************************/
 
 /* Compiling with gsl and blas
-   cc/gcc cFDAP.c -o cFDAP -lgsl -lgslcblas -lm */
+   cc/gcc cFDAP.c -o cFDAP -lgsl -lgslcblas -lm -ldl -lpthread
+   Adding -fopenmp spreads the Jacobian columns over all cores */
 
 #include <stdlib.h>
 #include <stddef.h>
 #include <stdio.h> 
+#include <stdarg.h>
 #include <string.h>
+#include <stdint.h>
+#include <errno.h>
 #include <math.h>
 #include <complex.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <gsl/gsl_vector.h>
 #include <gsl/gsl_matrix.h>
 #include <gsl/gsl_blas.h>
 #include <gsl/gsl_multifit_nlin.h>
 #include <gsl/gsl_cdf.h>
+#include <gsl/gsl_errno.h>
+#include "cFDAP_plugin.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 /* Global variables */
 #ifndef M_PI
@@ -31,7 +50,28 @@
 #define DEFAULT_KON_INIT 0.5 /* Starting value for kon */
 #define DEFAULT_KOFF_INIT 0.5 /* Starting value for koff */
 #define DEFAULT_XX_INIT 1.0 /* Starting value for xx = kon/koff */
+#define DEFAULT_IMM_INIT 0.0 /* Immobile fraction (fixed unless -free imm) */
 #define DEFAULT_FLAG_WEIGHT 0 /* By default, fitting is unweighted */
+#define DEFAULT_PDE_NX 10 /* Grid cells per half activation area */
+#define DEFAULT_PDE_DT 0.02 /* Time step of the PDE solver */
+#define DEFAULT_PDE_BC 0 /* Far boundary: 0 - open, 1 - closed */
+#define DEFAULT_PDE_NSIGMA 4.0 /* Open domain reaches R + NSIGMA*sqrt(Df*t_end) */
+#define PDE_STARTUP_STEPS 4 /* Implicit Euler half-steps damping CN oscillations */
+#define MAX_KIN 4 /* Maximum number of kinetic parameters of a model */
+#define MAX_PARAMS (MAX_KIN + 3) /* Kinetic parameters, Df, R and imm */
+#define FD_STEP 1e-4 /* Relative step of finite-difference derivatives */
+#define RESULTS_BUFFER (1 << 20) /* Stream buffer of the results file */
+#define RESULTS_MAGIC "cFDAPres" /* First bytes of a binary results file */
+#define RESULTS_VERSION 2
+#define RESULTS_NAME 32 /* Bytes per parameter name in a binary results file */
+#define DEFAULT_FLAG_CONTINUATION 0 /* By default, every iteration runs at full precision */
+#define CACHE_SIZE 4 /* Model evaluations remembered per fit */
+#define DEFAULT_FLAG_TRANSFORM 0 /* By default, parameters are fitted as they are */
+#define TR_MARGIN 1e-2 /* Starting values on a bound are moved this fraction inside */
+#define DEFAULT_DECIMATION 0 /* By default, every time point is fitted */
+#define DEFAULT_BINS 30 /* Bins of a decimated curve */
+#define DEC_CURV_FLOOR 0.1 /* Share of the mean bin density kept on flat parts */
+#define BATCH_EARLY 0.1 /* Share of the curve giving its early slope and its plateau */
 
 /* MACROS */
 #define NELEMS_1D(x) (sizeof(x)/sizeof((x)[0]))
@@ -40,22 +80,218 @@
 #define NELEMS_2D(x) (sizeof(x)/sizeof((x)[0][0]))
 
 /* STRUCTURES */
-struct data {
+/* Settings of the finite-difference solver used by 'fullModelPDE' */
+struct pde_params {
+    double L; /* Half length of the simulated domain */
+    double dt; /* Time step */
+    size_t nx; /* Grid cells per half activation area */
+    int bc; /* Boundary condition at x = L */
+    double * profile; /* Initial profile (x, intensity) pairs or NULL */
+    size_t n_profile;
+};
+
+/* Precision of the numerical inversion (n_int intervals up to the
+   frequency omega) and of the PDE time step (dt*dt_scale). With "-cf"
+   the fit starts at the first level and moves on to the next one once
+   the LM steps drop below its tolerance. The last level is the full
+   precision, which is also used for the covariance and the best fit */
+struct precision {
+    int n_int;
+    double omega;
+    double dt_scale;
+    double tol;
+};
+
+static const struct precision precision_schedule[] = {
+    {  1000,  20.0, 4.0, 1e-2 },
+    {  2500,  50.0, 2.0, 1e-3 },
+    { 10000, 200.0, 1.0, 1e-4 }
+};
+#define N_PRECISION NELEMS_1D(precision_schedule)
+#define LAPLACE_SIGMA 0.05 /* Real part of the inversion contour */
+#define PLUGIN_CHUNKS 16 /* Batches a plugin table is split into for OpenMP */
+#define MAX_PLUGINS 16 /* Different plugins loaded at the same time */
+#define SERVER_QUEUE 64 /* Requests waiting for a worker */
+#define SERVER_MAX_CONN 1024 /* Open connections */
+#define SERVER_TIMEOUT 30 /* Seconds a worker waits for a started frame */
+#define SERVER_MAX_ARGS 64 /* Options in a request */
+#define SERVER_MAX_REQUEST (64 << 20) /* Bytes in a request */
+
+/* Laplace image F(s) of a model, or one of its derivatives. "par"
+   holds the kinetic parameters of the model followed by Df and R */
+typedef double complex (*laplace_fn)(double complex s, const double *par);
+
+/* Closed-form part of a model in the time domain (time_fn) and its
+   Laplace image (part_fn). k = 0 is the function itself and k > 0
+   its derivative with respect to par[k - 1] */
+typedef double (*time_fn)(double t, const double *par, size_t k);
+typedef double complex (*part_fn)(double complex s, const double *par, size_t k);
+
+enum model_kind {
+    MODEL_LAPLACE, /* F(s) is inverted numerically */
+    MODEL_PDE /* FDAP(t) comes from pde_solve(...) */
+};
+
+struct model {
+    const char * name;
+    enum model_kind kind;
+    size_t n_kin; /* Number of kinetic parameters */
+    const char * kin_name[MAX_KIN];
+    double kin_init[MAX_KIN];
+    laplace_fn F;
+    laplace_fn dF[MAX_KIN + 2]; /* NULL - finite differences */
+    time_fn Ft; /* Closed-form FDAP(t) replacing the inversion, or NULL */
+    time_fn Pt; /* Closed-form part of FDAP(t), or NULL */
+    part_fn Ps; /* Laplace image of Pt, only the rest is inverted */
+    const struct cfdap_plugin * plugin; /* Batched F(s) from a shared object, or NULL */
+};
+
+/* Unbounded free parameters are fitted as they are, bounded ones
+   through a transform u that maps the whole real axis onto the allowed
+   range: v = lb + exp(u) for a lower bound only, v = ub - exp(u) for
+   an upper bound only and v = lb + (ub - lb)/(1 + exp(-u)) for two
+   bounds */
+enum transform {
+    TR_NONE,
+    TR_LOG,
+    TR_LOG_UB,
+    TR_LOGIT
+};
+
+/* Time points of a curve are either all fitted or averaged in bins
+   whose width grows logarithmically with time, or shrinks where the
+   curve bends (see decimate(...)) */
+enum decimation {
+    DEC_NONE,
+    DEC_LOG,
+    DEC_CURV
+};
+
+/* The full parameter vector of a fit: the kinetic parameters of the
+   model, Df, R and the immobile fraction imm, so that
+   FDAP(t) = imm + (1 - imm)*F(t). Each of them is either free or
+   fixed at "value", free ones can be bounded by [lb, ub] */
+struct params {
+    size_t n;
+    const char * name[MAX_PARAMS];
+    double value[MAX_PARAMS]; /* Starting or fixed value */
+    int free[MAX_PARAMS];
+    double lb[MAX_PARAMS];
+    double ub[MAX_PARAMS];
+    enum transform tr[MAX_PARAMS];
+    size_t p; /* Number of free parameters */
+    size_t idx[MAX_PARAMS]; /* Index of the k-th free parameter */
+};
+
+/* Everything that goes into one row of the results file */
+struct fit_result {
+    const char * id; /* Name of the input curve */
+    const char * m;
+    int status;
+    size_t iter;
+    size_t n;
+    size_t p;
+    const char * names[MAX_PARAMS];
+    double chisq_dof;
+    double fit[MAX_PARAMS];
+    double err[MAX_PARAMS];
+    double conf[MAX_PARAMS][3]; /* 95%, 97.5% and 99% */
+    double bound;
+    double bound_err;
+    double * curve; /* Best fit or NULL */
+};
+
+/* Last few model evaluations of a fit, keyed on the full parameter
+   vector and the precision level. An entry holds the curve Y, the
+   Jacobian dY or both, whichever has been asked for at that point */
+struct cache_entry {
+    size_t used; /* Time stamp of the last use */
+    int has_Y;
+    int has_dY;
+    const struct precision * prec;
+    double par[MAX_PARAMS];
+    double * Y;
+    double * dY;
+};
+
+struct eval_cache {
+    size_t clock; /* The least recently used entry is replaced */
+    size_t hits_f, misses_f; /* Curves */
+    size_t hits_df, misses_df; /* Jacobians */
+    struct cache_entry e[CACHE_SIZE];
+};
+
+/* Per-thread state that is kept warm between fits: the solver and
+   its matrices (reallocated only when n or p change), the model
+   evaluation cache and the inversion nodes of every precision level
+   together with a table buffer for laplace_table(...) */
+struct fit_workspace {
+    size_t n;
+    size_t p;
+    gsl_multifit_fdfsolver * s;
+    gsl_matrix * J;
+    gsl_matrix * covar;
+    struct eval_cache cache;
+    double complex * nodes[N_PRECISION];
+    double complex * table;
+};
+
+/* Everything that defines one fit, as given on the command line or
+   in a server request */
+struct fit_config {
+    const struct model * mod;
+    struct params ps;
     size_t n;
+    size_t w_flag;
     double Df;
     double R;
+    double t_ini;
+    double t_end;
+    struct pde_params pde;
+    char curve_name[80];
+    char std_name[80];
+    char output_prefix[80];
+    char results_name[80];
+    char batch_name[80]; /* List of curves fitted one after another */
+    int results_bin;
+    int with_curves;
+    int quiet; /* 1 - no per-iteration output, 2 - no output at all */
+    int continuation;
+    enum decimation dec;
+    size_t n_bins;
+    int dec_check; /* Also fit all points and compare */
+    char error[256]; /* Message of a failed parse_options(...) */
+};
+
+/* Solver statistics of one fit */
+struct fit_stats {
+    const char * method;
+    double chi0;
+    double chi;
+    size_t iter_level[N_PRECISION];
+    size_t nevalf;
+    size_t nevaldf;
+    size_t hits_f, misses_f, hits_df, misses_df;
+    double wall;
+};
+
+struct data {
+    size_t n;
     double * time;
     double * y;
     double * sigma;
-    char * m;
-    size_t p;
+    const struct model * model;
+    struct params * par;
     size_t w_flag;
+    struct pde_params * pde;
+    const struct precision * prec;
+    struct fit_workspace * ws; /* NULL - no caching, no warm tables */
 };
 
 /* FUNCTION DECLARATIONS */
-/* Functions with the '_x', '_kon' or '_koff' indeces are
- * derivatives of those functions with respect to '_x',
- * '_kon' and '_koff', respectively */
+/* Functions with the '_x', '_kon', '_koff', '_Df' or '_R' indeces
+ * are derivatives of those functions with respect to '_x', '_kon',
+ * '_koff', '_Df' and '_R', respectively */
 double complex fullModel(double complex s, double kon,
                          double koff, double Df, double R);
 double complex fullModel_kon(double complex s, double kon,
@@ -64,8 +300,8 @@ double complex fullModel_koff(double complex s, double kon,
                               double koff, double Df, double R);
 double complex effectiveDiffusion(double complex s, double x,
                                   double Df, double R);
-double complex effectiveDiffusion_x(double complex s, double x,
-                                    double Df, double R);
+double complex effectiveDiffusion_xx(double complex s, double x,
+                                     double Df, double R);
 double complex reactionDominantPure(double complex s, double kon,
                                     double koff, double Df, double R);
 double complex reactionDominantPure_kon(double complex s, double kon,
@@ -78,15 +314,65 @@ double complex hybridModel_kon(double complex s, double kon,
                                double koff, double Df, double R);
 double complex hybridModel_koff(double complex s, double kon,
                                 double koff, double Df, double R);
-double invlap_1(double t, double xx, double Df,
-                double R, char *m, int functionOrDerivative);
-double invlap_2(double t, double kon, double koff,
-                double Df, double R, char *m, int functionOrDerivative);
+double complex fullModel_Df(double complex s, double kon,
+                            double koff, double Df, double R);
+double complex fullModel_R(double complex s, double kon,
+                           double koff, double Df, double R);
+double complex effectiveDiffusion_Df(double complex s, double x,
+                                     double Df, double R);
+double complex effectiveDiffusion_R(double complex s, double x,
+                                    double Df, double R);
+double complex reactionDominantPure_Df(double complex s, double kon,
+                                       double koff, double Df, double R);
+double complex reactionDominantPure_R(double complex s, double kon,
+                                      double koff, double Df, double R);
+double complex hybridModel_Df(double complex s, double kon,
+                              double koff, double Df, double R);
+double complex hybridModel_R(double complex s, double kon,
+                             double koff, double Df, double R);
+const struct model * load_plugin(const char *path, char *error, size_t size);
+void laplace_nodes(const struct precision *prec, double complex *s);
+double invlap(double t, const double complex *Fs, const struct precision *prec);
+double effectiveDiffusion_t(double t, const double *par, size_t k);
+double reactionDominantPure_t(double t, const double *par, size_t k);
+double unitStep_t(double t, const double *par, size_t k);
+double complex unitStep_s(double complex s, const double *par, size_t k);
+int pde_solve(const struct pde_params *pp, double kon, double koff,
+              double Df, double R, const double *time, size_t n,
+              double *F, double **dF);
+const struct model * find_model(const char *name);
+void params_init(struct params *ps, const struct model *mod,
+                 double Df, double R);
+int param_index(const struct params *ps, const char *name);
+void params_update(struct params *ps);
+void params_transform(struct params *ps, size_t n_pos);
+double params_to_x(const struct params *ps, size_t j, double v);
+void params_expand(const struct params *ps, const gsl_vector *x,
+                   double *par, double *D);
+int model_eval(const struct data *d, const double *par, double *Y, double *dY);
+int cache_init(struct eval_cache *c, size_t n, size_t p);
+void cache_reset(struct eval_cache *c);
+void cache_free(struct eval_cache *c);
 int model_f(const gsl_vector * x, void *data, gsl_vector * f);
 int model_df(const gsl_vector * x, void *data, gsl_matrix * J);
 int model_fdf (const gsl_vector * x, void *data, gsl_vector * f, gsl_matrix * J);
 void print_state (size_t iter, gsl_multifit_fdfsolver * s, size_t p);
+void print_result_csv(FILE *out, const struct fit_result *r, int header);
+int write_result_csv(const char *name, const struct fit_result *r);
+int write_result_bin(const char *name, const struct fit_result *r);
 void bad_input(void);
+int parse_options(int argc, char *argv[], struct fit_config *cfg, int server);
+void fit_time_grid(const struct fit_config *cfg, double *time);
+size_t decimate(const struct fit_config *cfg, const double *time, const double *y,
+                const double *sigma, double *tb, double *yb, double *sb);
+void workspace_init(struct fit_workspace *ws);
+int workspace_setup(struct fit_workspace *ws, size_t n, size_t p);
+void workspace_free(struct fit_workspace *ws);
+int run_fit(const struct fit_config *cfg, double *time, double *y, double *sigma,
+            struct fit_workspace *ws, struct fit_result *res, struct fit_stats *st,
+            double *best_fit);
+int serve(const char *path, size_t n_workers);
+int run_batch(const struct fit_config *cfg);
 
 /* FUNCTIONS */
 
@@ -149,11 +435,261 @@ hybridModel_koff(double complex s, double kon, double koff, double Df, double R)
     return -cexp(-2.0*csqrt(R*R*s/Df*kon/(s + koff)))/(4.0*s*cpow(s + koff, 3)*cpow(R*R*s/Df*kon/(s + koff), 3.0/2.0))*(R*R*s/Df*kon*(koff + 2.0*s)*cexp(2.0*csqrt(R*R*s/Df*kon/(s + koff))) - 2.0*koff*(s + koff)*cpow(R*R*s/Df*kon/(s + koff), 3.0/2.0) - R*R*s/Df*kon*koff - 2.0*kon*R*R*cpow(s, 2.0)/Df);
 }
 
-/* Function invlap(t, kon, koff) numerically inverts a Laplace
+/* All models depend on Df and R only through q = sqrt(R*R*s*g(s)/Df)
+   in the diffusive term A(s)*(1/s - (1 - exp(-2q))/(2sq)). Therefore
+   dF/dDf = -A*dG/Df and dF/dR = 2*A*dG/R with the function dG below */
+static double complex
+dG(double complex s, double complex q) {
+    return (1.0 - (1.0 + 2.0*q)*cexp(-2.0*q))/(4.0*s*q);
+}
+
+double complex
+fullModel_Df(double complex s, double kon, double koff, double Df, double R) {
+    return -(1.0/(1.0 + kon/koff))*(1.0 + kon/(s + koff))*dG(s, csqrt(R*R*s*(1.0 + kon/(s + koff))/Df))/Df;
+}
+
+double complex
+fullModel_R(double complex s, double kon, double koff, double Df, double R) {
+    return 2.0*(1.0/(1.0 + kon/koff))*(1.0 + kon/(s + koff))*dG(s, csqrt(R*R*s*(1.0 + kon/(s + koff))/Df))/R;
+}
+
+double complex
+effectiveDiffusion_Df(double complex s, double xx, double Df, double R) {
+    return -dG(s, csqrt(R*R*s*(1.0 + xx)/Df))/Df;
+}
+
+double complex
+effectiveDiffusion_R(double complex s, double xx, double Df, double R) {
+    return 2.0*dG(s, csqrt(R*R*s*(1.0 + xx)/Df))/R;
+}
+
+double complex
+reactionDominantPure_Df(double complex s, double kon, double koff, double Df, double R) {
+    return -koff/(kon + koff)*dG(s, csqrt(R*R*s/Df))/Df;
+}
+
+double complex
+reactionDominantPure_R(double complex s, double kon, double koff, double Df, double R) {
+    return 2.0*koff/(kon + koff)*dG(s, csqrt(R*R*s/Df))/R;
+}
+
+double complex
+hybridModel_Df(double complex s, double kon, double koff, double Df, double R) {
+    return -(koff/(s + koff))*dG(s, csqrt(R*R*kon*s/Df/(s + koff)))/Df;
+}
+
+double complex
+hybridModel_R(double complex s, double kon, double koff, double Df, double R) {
+    return 2.0*(koff/(s + koff))*dG(s, csqrt(R*R*kon*s/Df/(s + koff)))/R;
+}
+
+/* Closed-form inverses. The diffusive term 1/s - (1 - exp(-2q))/(2sq)
+   with q = R*sqrt(s/D) is the fraction of an initially uniform
+   profile in [-R, R] that remains there after free diffusion with
+   the coefficient D,
+
+       M(u) = erf(u) - (1 - exp(-u^2))/(u*sqrt(pi)),  u = R/sqrt(D*t),
+
+   with dM/du = (1 - exp(-u^2))/(u^2*sqrt(pi)). This gives
+   effectiveDiffusion (D = Df/(1 + x)) and reactionDominantPure
+   (D = Df plus the exponential koff bound fraction) exactly. The
+   other models keep their numerical inversion, but the unit step
+   1/s, which decays slowest along the integration path, is split
+   off and added analytically */
+static double
+diffusive_M(double u) {
+    return erf(u) + expm1(-u*u)/(u*sqrt(M_PI));
+}
+
+static double
+diffusive_dM(double u) {
+    return -expm1(-u*u)/(u*u*sqrt(M_PI));
+}
+
+double
+effectiveDiffusion_t(double t, const double *par, size_t k) {
+    /* par = { x, Df, R } */
+    double xx = par[0], Df = par[1], R = par[2], u;
+
+    if (t <= 0.0) {
+        return (k == 0) ? 1.0 : 0.0;
+    }
+    u = R*sqrt((1.0 + xx)/(Df*t));
+    switch (k) {
+        case 0: return diffusive_M(u);
+        case 1: return diffusive_dM(u)*u/(2.0*(1.0 + xx));
+        case 2: return -diffusive_dM(u)*u/(2.0*Df);
+        case 3: return diffusive_dM(u)*u/R;
+        default: return 0.0;
+    }
+}
+
+double
+reactionDominantPure_t(double t, const double *par, size_t k) {
+    /* par = { kon, koff, Df, R } */
+    double kon = par[0], koff = par[1], Df = par[2], R = par[3];
+    double u, M, e = exp(-koff*t), kk = (kon + koff)*(kon + koff);
+
+    if (t <= 0.0) {
+        return (k == 0) ? 1.0 : 0.0;
+    }
+    u = R/sqrt(Df*t);
+    M = diffusive_M(u);
+    switch (k) {
+        case 0: return koff/(kon + koff)*M + kon/(kon + koff)*e;
+        case 1: return koff/kk*(e - M);
+        case 2: return kon/kk*(M - e) - kon/(kon + koff)*t*e;
+        case 3: return -koff/(kon + koff)*diffusive_dM(u)*u/(2.0*Df);
+        case 4: return koff/(kon + koff)*diffusive_dM(u)*u/R;
+        default: return 0.0;
+    }
+}
+
+double
+unitStep_t(double t, const double *par, size_t k) {
+    return (k == 0) ? 1.0 : 0.0;
+}
+
+double complex
+unitStep_s(double complex s, const double *par, size_t k) {
+    return (k == 0) ? 1.0/s : 0.0;
+}
+
+/* Adapters from the functions above to laplace_fn */
+#define LAPLACE_1(fun) static double complex \
+    fun##_v(double complex s, const double *par) { return fun(s, par[0], par[1], par[2]); }
+#define LAPLACE_2(fun) static double complex \
+    fun##_v(double complex s, const double *par) { return fun(s, par[0], par[1], par[2], par[3]); }
+
+LAPLACE_2(fullModel) LAPLACE_2(fullModel_kon) LAPLACE_2(fullModel_koff)
+LAPLACE_2(fullModel_Df) LAPLACE_2(fullModel_R)
+LAPLACE_1(effectiveDiffusion) LAPLACE_1(effectiveDiffusion_xx)
+LAPLACE_1(effectiveDiffusion_Df) LAPLACE_1(effectiveDiffusion_R)
+LAPLACE_2(reactionDominantPure) LAPLACE_2(reactionDominantPure_kon) LAPLACE_2(reactionDominantPure_koff)
+LAPLACE_2(reactionDominantPure_Df) LAPLACE_2(reactionDominantPure_R)
+LAPLACE_2(hybridModel) LAPLACE_2(hybridModel_kon) LAPLACE_2(hybridModel_koff)
+LAPLACE_2(hybridModel_Df) LAPLACE_2(hybridModel_R)
+
+/* All models known to cFDAP. A new model needs its Laplace image,
+   the derivatives (or NULL for finite differences) and a line here.
+   A closed-form FDAP(t), or a closed-form part of it, is optional */
+static const struct model models[] = {
+    { "fullModel", MODEL_LAPLACE, 2, { "kon", "koff" }, { DEFAULT_KON_INIT, DEFAULT_KOFF_INIT },
+      fullModel_v, { fullModel_kon_v, fullModel_koff_v, fullModel_Df_v, fullModel_R_v },
+      NULL, unitStep_t, unitStep_s },
+    { "hybridModel", MODEL_LAPLACE, 2, { "kon", "koff" }, { DEFAULT_KON_INIT, DEFAULT_KOFF_INIT },
+      hybridModel_v, { hybridModel_kon_v, hybridModel_koff_v, hybridModel_Df_v, hybridModel_R_v },
+      NULL, unitStep_t, unitStep_s },
+    { "reactionDominantPure", MODEL_LAPLACE, 2, { "kon", "koff" }, { DEFAULT_KON_INIT, DEFAULT_KOFF_INIT },
+      reactionDominantPure_v, { reactionDominantPure_kon_v, reactionDominantPure_koff_v,
+                                reactionDominantPure_Df_v, reactionDominantPure_R_v },
+      reactionDominantPure_t, NULL, NULL },
+    { "effectiveDiffusion", MODEL_LAPLACE, 1, { "x" }, { DEFAULT_XX_INIT },
+      effectiveDiffusion_v, { effectiveDiffusion_xx_v, effectiveDiffusion_Df_v, effectiveDiffusion_R_v },
+      effectiveDiffusion_t, NULL, NULL },
+    { "fullModelPDE", MODEL_PDE, 2, { "kon", "koff" }, { DEFAULT_KON_INIT, DEFAULT_KOFF_INIT },
+      NULL, { NULL }, NULL, NULL, NULL }
+};
+
+const struct model *
+find_model(const char *name) {
+    size_t k;
+
+    for (k = 0; k < NELEMS_1D(models); k++) {
+        if (strcmp(models[k].name, name) == 0) {
+            return &models[k];
+        }
+    }
+    return NULL;
+}
+
+/* Function load_plugin(...) opens a model plugin (see cFDAP_plugin.h)
+   and wraps its descriptor into a struct model. The shared object
+   stays loaded until cFDAP exits; loading it again (e.g. by another
+   server request) returns the same model. On failure, the message
+   is stored in "error" and NULL is returned */
+const struct model *
+load_plugin(const char *path, char *error, size_t size) {
+    static struct model loaded[MAX_PLUGINS];
+    static size_t n_loaded = 0;
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    const struct model *mod = NULL;
+    const struct cfdap_plugin *pl;
+    size_t k;
+    void *handle;
+
+    pthread_mutex_lock(&lock);
+    handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (handle == NULL) {
+        snprintf(error, size, "ERROR: Plugin cannot be loaded: %s\n\n", dlerror());
+        goto done;
+    }
+    pl = (const struct cfdap_plugin *) dlsym(handle, "cfdap_plugin");
+    if (pl == NULL) {
+        snprintf(error, size, "ERROR: %s exports no 'cfdap_plugin' descriptor.\n\n", path);
+        goto done;
+    }
+    for (k = 0; k < n_loaded; k++) {
+        if (loaded[k].plugin == pl) {
+            /* The first dlopen(...) keeps it loaded */
+            dlclose(handle);
+            handle = NULL;
+            mod = &loaded[k];
+            goto done;
+        }
+    }
+    if (pl->abi != CFDAP_PLUGIN_ABI) {
+        snprintf(error, size, "ERROR: %s was built for plugin ABI %d, cFDAP needs %d.\n\n", path, pl->abi, CFDAP_PLUGIN_ABI);
+        goto done;
+    }
+    if (pl->name == NULL || pl->eval == NULL || pl->n_kin < 1 || pl->n_kin > MAX_KIN) {
+        snprintf(error, size, "ERROR: %s has an invalid model descriptor.\n\n", path);
+        goto done;
+    }
+    if (n_loaded == MAX_PLUGINS) {
+        snprintf(error, size, "ERROR: More than %d plugins cannot be loaded.\n\n", MAX_PLUGINS);
+        goto done;
+    }
+
+    loaded[n_loaded].name = pl->name;
+    loaded[n_loaded].kind = MODEL_LAPLACE;
+    loaded[n_loaded].n_kin = pl->n_kin;
+    for (k = 0; k < pl->n_kin; k++) {
+        loaded[n_loaded].kin_name[k] = pl->kin_name[k];
+        loaded[n_loaded].kin_init[k] = pl->kin_init[k];
+    }
+    loaded[n_loaded].plugin = pl;
+    mod = &loaded[n_loaded++];
+
+done:
+    if (mod == NULL && handle != NULL) {
+        dlclose(handle);
+    }
+    pthread_mutex_unlock(&lock);
+    return mod;
+}
+
+/* Function laplace_nodes(...) returns the n_int + 1 nodes
+   s_j = sigma + i*w_j, w_j = j*omega/n_int, at which invlap(...)
+   needs the Laplace image. They do not depend on t, so F(s) is
+   tabulated once per parameter set and shared by all time points */
+void
+laplace_nodes(const struct precision *prec, double complex *s) {
+    int i;
+    double delta = prec->omega/((double) prec->n_int);
+
+    for (i = 0; i <= prec->n_int; i++) {
+        s[i] = LAPLACE_SIGMA + (i*delta)*I;
+    }
+}
+
+/* Function invlap(t, Fs, prec) numerically inverts a Laplace
    image function F(s) into f(t) using the Fast Fourier Transform
    (FFT) algorithm for a specific time moment "t", an upper
    frequency limit "omega", a real parameter "sigma" and the
-   number of integration intervals "n_int".
+   number of integration intervals "n_int". The latter two are
+   taken from "prec", Fs[j] = F(s_j) at the nodes of
+   laplace_nodes(...).
    
    Recommended values: omega > 100, n_int = 50*omega
    Default values:     omega = 200, n_int = 10000
@@ -176,290 +712,1113 @@ hybridModel_koff(double complex s, double kon, double koff, double Df, double R)
   
    Modified and translated into C code by Maxim Igaev, 2015 */
 double
-invlap_1(double t, double xx, double Df, double R, char *m, int functionOrDerivative) {
+invlap(double t, const double complex *Fs, const struct precision *prec) {
     /* defining constants */
-    int i, n_int = 10000;
-    double omega = 200.0, sig = 0.05, delta = omega/((double) n_int);
-    double sum = 0.0, wi = 0.0, wf, fi, ff;
-    double complex witi, wfti; 
-
-    /* loading one of the laplace image functions */
-    double complex (*laplace_fun)();
-    if (strcmp(m, "effectiveDiffusion") == 0) {
-        if (functionOrDerivative == 0) {
-            laplace_fun = &effectiveDiffusion;
-        }
-        else if (functionOrDerivative == 1) {
-            laplace_fun = &effectiveDiffusion_xx;
-        }
-        else {
-            fprintf(stderr, "ERROR: in 'invlap_1': functionOrDerivative takes only values 0 or 1 for the model and derivative, respectively.");
-        }
+    int i, n_int = prec->n_int;
+    double omega = prec->omega, delta = omega/((double) n_int);
+    double sum = 0.0;
+    double complex z = 1.0, dz = cexp((delta*t)*I); /* z = exp(i*w_j*t) */
+
+    /* Trapezoidal rule, the end points have half the weight */
+    for(i = 0; i <= n_int; i++) {
+        double fi = creal(z*Fs[i]);
+        sum += (i == 0 || i == n_int) ? 0.5*delta*fi : delta*fi;
+        z *= dz;
     }
 
-    for(i = 0; i < n_int; i++) {
-        witi = 0.0 + (wi*t)*I;
+    return sum*exp(LAPLACE_SIGMA*t)/M_PI;
+}
 
-        wf = wi + delta;
-        wfti = 0.0 + (wf*t)*I;
+/* Function pde_solve(...) integrates the full reaction-diffusion
+   system
+
+       df/dt = Df d2f/dx2 - kon f + koff c
+       dc/dt = kon f - koff c
+
+   for free (f) and bound (c) proteins numerically, so that models
+   without a closed-form Laplace image can be fitted as well. Only
+   the half domain [0, L] is simulated (the activation area is
+   symmetric about x = 0) on a cell-centred grid with "nx" cells
+   per half activation area R. The far boundary is either open
+   (bc = 0, f = 0 at x = L) or closed (bc = 1, no flux).
+
+   Time stepping is Crank-Nicolson, (I - hM) u' = (I + hM) u with
+   h = dt/2, preceded by PDE_STARTUP_STEPS implicit Euler half-steps
+   which share the same left-hand side and damp the oscillations
+   caused by the sharp edge of the activation area. The 2x2 reaction
+   block of every cell is eliminated locally, which leaves a single
+   tridiagonal system for f that is factorized once per call and
+   solved in O(N) per step.
+
+   FDAP(t) is the total (f + c) intensity in [0, R] normalized by
+   its initial value. The initial profile is uniform in [0, R] or
+   interpolated from (x, intensity) pairs, in chemical equilibrium
+   f:c = koff:kon in both cases. If dF is not NULL, the derivatives
+   of FDAP(t) with respect to kon, koff and Df are written to those
+   of dF[0], dF[1] and dF[2] which are not NULL. They are computed
+   from the forward sensitivity equations of the discrete scheme,
+   which reuse the same factorization.
+
+   FDAP(t) is evaluated at the n moments in "time" by linear
+   interpolation between the steps of the solver. */
+struct cn_system {
+    size_t N; /* Number of cells */
+    double h, a, kon, koff; /* h = dt/2, a = h*Df/dx^2 */
+    double *lower, *diag, *upper; /* Laplacian stencil of each cell */
+    double *cp, *inv; /* Thomas factorization of the f system */
+};
 
-        fi = creal(cexp(witi)*laplace_fun(sig + wi*I, xx, Df, R));
-        ff = creal(cexp(wfti)*laplace_fun(sig + wf*I, xx, Df, R));
-        sum += 0.5*(wf - wi)*(fi + ff);
-        wi = wf;
+static void
+cn_apply(const struct cn_system *sys, double sign, const double *uf,
+         const double *uc, double *rf, double *rc) {
+    /* (I + sign*hM) u */
+    size_t j;
+    double h = sign*sys->h;
+
+    for (j = 0; j < sys->N; j++) {
+        double lap = sys->diag[j]*uf[j];
+        if (j > 0) lap += sys->lower[j]*uf[j - 1];
+        if (j < sys->N - 1) lap += sys->upper[j]*uf[j + 1];
+        rf[j] = uf[j] + sign*sys->a*lap - h*sys->kon*uf[j] + h*sys->koff*uc[j];
+        rc[j] = uc[j] + h*sys->kon*uf[j] - h*sys->koff*uc[j];
     }
+}
 
-    return creal(sum*cexp(sig*t)/M_PI);
+static void
+cn_solve(const struct cn_system *sys, const double *rf, const double *rc,
+         double *vf, double *vc) {
+    /* Solves (I - hM) v = r. The c row gives
+       v_c = (r_c + h kon v_f)/(1 + h koff), which turns the f rows
+       into a tridiagonal system */
+    size_t j, N = sys->N;
+    double e = 1.0/(1.0 + sys->h*sys->koff);
+
+    for (j = 0; j < N; j++) {
+        double b = rf[j] + sys->h*sys->koff*e*rc[j];
+        if (j > 0) b += sys->a*sys->lower[j]*vf[j - 1];
+        vf[j] = b*sys->inv[j];
+    }
+    for (j = N - 1; j-- > 0;) {
+        vf[j] -= sys->cp[j]*vf[j + 1];
+    }
+    for (j = 0; j < N; j++) {
+        vc[j] = (rc[j] + sys->h*sys->kon*vf[j])*e;
+    }
 }
 
-double
-invlap_2(double t, double kon, double koff, double Df, double R, char *m, int functionOrDerivative) {
-    /* defining constants */
-    int i, n_int = 10000;
-    double omega = 200.0, sig = 0.05, delta = omega/((double) n_int);
-    double sum = 0.0, wi = 0.0, wf, fi, ff;
-    double complex witi, wfti; 
+static double
+pde_profile(const struct pde_params *pp, double x, double R) {
+    size_t k;
+    const double *pr = pp->profile;
 
-    /* loading one of the laplace image functions */
-    double complex (*laplace_fun)();
-    if (strcmp(m, "fullModel") == 0) {
-        if (functionOrDerivative == 0) {
-            laplace_fun = &fullModel;
-        }
-        else if (functionOrDerivative == 1) {
-            laplace_fun = &fullModel_kon;
-        }
-        else if (functionOrDerivative == 2) {
-            laplace_fun = &fullModel_koff;
-        }
-        else {
-            fprintf(stderr, "ERROR: in 'invlap_2': functionOrDerivative takes only values 0, 1 or 2 for the model and derivatives, respectively.");
-        }
+    if (pr == NULL) {
+        return (x < R) ? 1.0 : 0.0;
     }
-    else if (strcmp(m, "hybridModel") == 0) {
-        if (functionOrDerivative == 0) {
-            laplace_fun = &hybridModel;
-        }
-        else if (functionOrDerivative == 1) {
-            laplace_fun = &hybridModel_kon;
-        }
-        else if (functionOrDerivative == 2) {
-            laplace_fun = &hybridModel_koff;
-        }
-        else {
-            fprintf(stderr, "ERROR: in 'invlap_2': functionOrDerivative takes only values 0, 1 or 2 for the model and derivatives, respectively.");
+    if (x <= pr[0]) return pr[1];
+    for (k = 1; k < pp->n_profile; k++) {
+        if (x <= pr[2*k]) {
+            return pr[2*k - 1] + (pr[2*k + 1] - pr[2*k - 1])*(x - pr[2*k - 2])/(pr[2*k] - pr[2*k - 2]);
         }
     }
-    else if (strcmp(m, "reactionDominantPure") == 0) {
-        if (functionOrDerivative == 0) {
-            laplace_fun = &reactionDominantPure;
-        }
-        else if (functionOrDerivative == 1) {
-            laplace_fun = &reactionDominantPure_kon;
+    return 0.0;
+}
+
+static void
+pde_source(const struct cn_system *sys, int which, double Df, const double *f,
+           const double *c, double *rf, double *rc) {
+    /* Adds h*M_k*u, where M_k is the derivative of M with respect
+       to kon (which = 0), koff (1) or Df (2) */
+    size_t j, N = sys->N;
+
+    for (j = 0; j < N; j++) {
+        if (which == 0) {
+            rf[j] -= sys->h*f[j];
+            rc[j] += sys->h*f[j];
         }
-        else if (functionOrDerivative == 2) {
-            laplace_fun = &reactionDominantPure_koff;
+        else if (which == 1) {
+            rf[j] += sys->h*c[j];
+            rc[j] -= sys->h*c[j];
         }
         else {
-            fprintf(stderr, "ERROR: in 'invlap_2': functionOrDerivative takes only values 0, 1 or 2 for the model and derivatives, respectively.");
+            double lap = sys->diag[j]*f[j];
+            if (j > 0) lap += sys->lower[j]*f[j - 1];
+            if (j < N - 1) lap += sys->upper[j]*f[j + 1];
+            rf[j] += sys->a/Df*lap;
         }
     }
-
-    for(i = 0; i < n_int; i++) {
-        witi = 0.0 + (wi*t)*I;
-
-        wf = wi + delta;
-        wfti = 0.0 + (wf*t)*I;
-
-        fi = creal(cexp(witi)*laplace_fun(sig + wi*I, kon, koff, Df, R));
-        ff = creal(cexp(wfti)*laplace_fun(sig + wf*I, kon, koff, Df, R));
-        sum += 0.5*(wf - wi)*(fi + ff);
-        wi = wf;
-    }
-
-    return creal(sum*cexp(sig*t)/M_PI);
 }
 
 int
-model_f (const gsl_vector * x, void *data, 
-        gsl_vector * f) {
-    size_t n = ((struct data *)data)->n;
-    double Df = ((struct data *)data)->Df;
-    double R = ((struct data *)data)->R;
-    double *time = ((struct data *)data)->time;
-    double *y = ((struct data *)data)->y;
-    double *sigma = ((struct data *) data)->sigma;
-    char *m = ((struct data *) data)->m;
-    size_t p = ((struct data *)data)->p;
-    size_t w_flag = ((struct data *)data)->w_flag;
+pde_solve(const struct pde_params *pp, double kon, double koff,
+          double Df, double R, const double *time, size_t n,
+          double *F, double **dF) {
+    size_t i, j, k, q, N, nR = pp->nx, nsens = 0;
+    int which[3];
+    double *out[4];
+    double dx = R/(double) nR, dt = pp->dt, t = 0.0;
+    double total0 = 0.0, obs_prev[4], obs[4];
+    struct cn_system sys;
+
+    out[0] = F;
+    for (k = 0; dF != NULL && k < 3; k++) {
+        if (dF[k] != NULL) {
+            which[nsens] = k;
+            out[++nsens] = dF[k];
+        }
+    }
 
-    size_t i;
-    double xx, kon, koff;
+    N = (size_t) ceil(pp->L/dx);
+    if (N <= nR) N = nR + 1;
 
-    if (p == 1) {
-        xx = gsl_vector_get (x, 0);
+    /* u = (f, c) and the sensitivities (df/dk, dc/dk) are stored as
+       consecutive pairs */
+    double *buf = malloc(sizeof(double)*N*(5 + 2*2*(1 + nsens)));
+    if (buf == NULL) {
+        fprintf(stderr, "ERROR: in 'pde_solve': Cannot allocate %zu grid cells.\n", N);
+        return GSL_ENOMEM;
+    }
+    sys.N = N; sys.h = 0.5*dt; sys.a = 0.5*dt*Df/dx/dx;
+    sys.kon = kon; sys.koff = koff;
+    sys.lower = buf; sys.diag = buf + N; sys.upper = buf + 2*N;
+    sys.cp = buf + 3*N; sys.inv = buf + 4*N;
+    double *u = buf + 5*N; /* u[2*q*N], u[(2*q + 1)*N]: f and c of state q */
+    double *r = u + 2*(1 + nsens)*N;
+
+    /* Laplacian with no flux at x = 0 and the chosen condition at x = L */
+    for (j = 0; j < N; j++) {
+        sys.lower[j] = (j > 0) ? 1.0 : 0.0;
+        sys.upper[j] = (j < N - 1) ? 1.0 : 0.0;
+        sys.diag[j] = -sys.lower[j] - sys.upper[j];
+    }
+    if (pp->bc == 0) sys.diag[N - 1] -= 2.0;
 
-        /* Importing one of the model functions */    
-        double (*inverted_fun)();
-        inverted_fun = &invlap_1;
+    /* Thomas factorization of the f rows of (I - hM) */
+    {
+        double e = 1.0/(1.0 + sys.h*koff);
+        double d0 = 1.0 + sys.h*kon - sys.h*koff*sys.h*kon*e;
+        for (j = 0; j < N; j++) {
+            double d = d0 - sys.a*sys.diag[j];
+            if (j > 0) d += sys.a*sys.lower[j]*sys.cp[j - 1];
+            sys.inv[j] = 1.0/d;
+            sys.cp[j] = -sys.a*sys.upper[j]*sys.inv[j];
+        }
+    }
 
-        for (i = 0; i < n; i++) {
-            /* Model Yi = A * exp(-lambda * i) + b */
-            //double Yi = A * exp (-lambda * t) + b;
-            
-            double Yi = inverted_fun(time[i], xx, Df, R, m, 0);
-            if (w_flag == 0) {
-                gsl_vector_set (f, i, (Yi - y[i]));
+    /* Initial conditions in chemical equilibrium */
+    for (j = 0; j < N; j++) {
+        double g = pde_profile(pp, ((double) j + 0.5)*dx, R);
+        double kk = (kon + koff)*(kon + koff);
+        u[j] = g*koff/(kon + koff);
+        u[N + j] = g*kon/(kon + koff);
+        for (q = 1; q <= nsens; q++) {
+            double *sf = u + 2*q*N, *sc = sf + N;
+            if (which[q - 1] == 0) {
+                sf[j] = -g*koff/kk; sc[j] = g*koff/kk;
             }
-            else if (w_flag == 1) {
-                gsl_vector_set (f, i, (Yi - y[i])/sigma[i]);
+            else if (which[q - 1] == 1) {
+                sf[j] = g*kon/kk; sc[j] = -g*kon/kk;
             }
             else {
-                fprintf(stderr, "ERROR: in 'model_f': Parameter w_flag is neither 0 nor 1.\n");
-                exit(1);
+                sf[j] = 0.0; sc[j] = 0.0;
             }
         }
+        if (j < nR) total0 += g;
+    }
+    if (total0 <= 0.0) {
+        fprintf(stderr, "ERROR: in 'pde_solve': The initial profile is zero inside the activation area.\n");
+        free(buf);
+        return GSL_EDOM;
     }
-    else if (p == 2) {
-        kon = gsl_vector_get (x, 0);
-        koff = gsl_vector_get (x, 1);
-
-        /* Importing one of the model functions */    
-        double (*inverted_fun)();
-        inverted_fun = &invlap_2;
 
-        for (i = 0; i < n; i++) {
-            /* Model Yi = A * exp(-lambda * i) + b */
-            //double Yi = A * exp (-lambda * t) + b;
+    for (q = 0; q <= nsens; q++) {
+        obs_prev[q] = 0.0;
+        for (j = 0; j < nR; j++) obs_prev[q] += u[2*q*N + j] + u[(2*q + 1)*N + j];
+        obs_prev[q] /= total0;
+    }
 
-            double Yi = inverted_fun(time[i], kon, koff, Df, R, m, 0);
-            if (w_flag == 0) {
-                gsl_vector_set (f, i, (Yi - y[i]));
-            }
-            else if (w_flag == 1) {
-                gsl_vector_set (f, i, (Yi - y[i])/sigma[i]);
+    i = 0;
+    while (i < n && time[i] <= 0.0) {
+        for (q = 0; q <= nsens; q++) out[q][i] = obs_prev[q];
+        i++;
+    }
+    size_t step = 0;
+    while (i < n) {
+        int startup = step < PDE_STARTUP_STEPS;
+        double tau = startup ? sys.h : dt;
+        double *f = u, *c = u + N;
+
+        /* r = u (implicit Euler) or (I + hM) u (Crank-Nicolson). The
+           sensitivities also get the old-state part of h*M_k*u */
+        for (q = 0; q <= nsens; q++) {
+            double *sf = u + 2*q*N, *sc = sf + N, *rf = r + 2*q*N, *rc = rf + N;
+            if (startup) {
+                memcpy(rf, sf, sizeof(double)*2*N);
             }
             else {
-                fprintf(stderr, "ERROR: in 'model_f': Parameter w_flag is neither 0 nor 1.\n");
-                exit(1);
+                cn_apply(&sys, 1.0, sf, sc, rf, rc);
+                if (q > 0) pde_source(&sys, which[q - 1], Df, f, c, rf, rc);
             }
         }
-    }
-    else {
-        fprintf(stderr, "ERROR: in 'model_f': Parameter p is neither 1 nor 2.\n");
-        exit(1);
+        cn_solve(&sys, r, r + N, f, c);
+        for (q = 1; q <= nsens; q++) {
+            double *rf = r + 2*q*N, *rc = rf + N;
+            pde_source(&sys, which[q - 1], Df, f, c, rf, rc);
+            cn_solve(&sys, rf, rc, u + 2*q*N, u + (2*q + 1)*N);
+        }
+        step++;
+        t += tau;
+
+        for (q = 0; q <= nsens; q++) {
+            obs[q] = 0.0;
+            for (j = 0; j < nR; j++) obs[q] += u[2*q*N + j] + u[(2*q + 1)*N + j];
+            obs[q] /= total0;
+        }
+        while (i < n && time[i] <= t) {
+            double w = (time[i] - (t - tau))/tau;
+            for (q = 0; q <= nsens; q++) out[q][i] = (1.0 - w)*obs_prev[q] + w*obs[q];
+            i++;
+        }
+        memcpy(obs_prev, obs, sizeof(obs));
     }
 
+    free(buf);
     return GSL_SUCCESS;
 }
 
+/* Functions params_init(...), params_update(...),
+   params_transform(...), params_to_x(...) and params_expand(...)
+   manage the full parameter vector. By default the kinetic
+   parameters are free and Df, R and imm are fixed */
+void
+params_init(struct params *ps, const struct model *mod, double Df, double R) {
+    size_t k;
+
+    ps->n = mod->n_kin + 3;
+    for (k = 0; k < ps->n; k++) {
+        ps->free[k] = (k < mod->n_kin);
+        ps->lb[k] = -GSL_POSINF;
+        ps->ub[k] = GSL_POSINF;
+        ps->tr[k] = TR_NONE;
+        if (k < mod->n_kin) {
+            ps->name[k] = mod->kin_name[k];
+            ps->value[k] = mod->kin_init[k];
+        }
+    }
+    ps->name[mod->n_kin] = "Df";
+    ps->value[mod->n_kin] = Df;
+    ps->name[mod->n_kin + 1] = "R";
+    ps->value[mod->n_kin + 1] = R;
+    ps->name[mod->n_kin + 2] = "imm";
+    ps->value[mod->n_kin + 2] = DEFAULT_IMM_INIT;
+    ps->lb[mod->n_kin + 2] = 0.0;
+    ps->ub[mod->n_kin + 2] = 1.0;
+    params_update(ps);
+}
+
 int
-model_df(const gsl_vector * x, void *data,
-        gsl_matrix * J) {
-    size_t n = ((struct data *)data)->n;
-    double Df = ((struct data *)data)->Df;
-    double R = ((struct data *)data)->R;
-    double *time = ((struct data *) data)->time;
-    double *sigma = ((struct data *) data)->sigma;
-    char *m = ((struct data *) data)->m;
-    size_t p = ((struct data *)data)->p;
-    size_t w_flag = ((struct data *)data)->w_flag;
+param_index(const struct params *ps, const char *name) {
+    size_t k;
 
-    size_t i;
-    double xx, kon, koff;
+    for (k = 0; k < ps->n; k++) {
+        if (strcmp(ps->name[k], name) == 0) {
+            return k;
+        }
+    }
+    return -1;
+}
 
-    if (p == 1) {
-        xx = gsl_vector_get (x, 0); 
+void
+params_update(struct params *ps) {
+    size_t k;
 
-        /* Importing one of the model functions */    
-        double (*inverted_fun)();
-        inverted_fun = &invlap_1;
+    ps->p = 0;
+    for (k = 0; k < ps->n; k++) {
+        if (ps->free[k]) {
+            ps->idx[ps->p++] = k;
+        }
+    }
+}
 
-        for (i = 0; i < n; i++) {
-            /* Jacobian matrix J(i,j) = dfi / dxj, */
-            /* where fi = (Yi - yi)/sigma[i],      */
-            /*       Yi = A * exp(-lambda * i) + b  */
-            /* and the xj are the parameters (A,lambda,b) */
+void
+params_transform(struct params *ps, size_t n_pos) {
+    /* The first n_pos parameters (rates, Df and R) are positive. A
+       parameter pinned by lb == ub stays untransformed */
+    size_t j;
+
+    for (j = 0; j < ps->n; j++) {
+        if (j < n_pos && !(ps->lb[j] > 0.0)) {
+            ps->lb[j] = 0.0;
+        }
+        if (ps->lb[j] == ps->ub[j]) {
+            ps->tr[j] = TR_NONE;
+        }
+        else if (gsl_finite(ps->lb[j]) && gsl_finite(ps->ub[j])) {
+            ps->tr[j] = TR_LOGIT;
+        }
+        else if (gsl_finite(ps->lb[j])) {
+            ps->tr[j] = TR_LOG;
+        }
+        else if (gsl_finite(ps->ub[j])) {
+            ps->tr[j] = TR_LOG_UB;
+        }
+        else {
+            ps->tr[j] = TR_NONE;
+        }
+    }
+}
 
-            if (w_flag == 0) {
-                gsl_matrix_set (J, i, 0, inverted_fun(time[i], xx, Df, R, m, 1));
-            }
-            else if (w_flag == 1)
-            {
-                gsl_matrix_set (J, i, 0, inverted_fun(time[i], xx, Df, R, m, 1)/sigma[i]);
-            }
-            else {
-                fprintf(stderr, "ERROR: in 'model_df': Parameter w_flag is neither 0 nor 1.\n");
-                exit(1);
-            }
+double
+params_to_x(const struct params *ps, size_t j, double v) {
+    double e;
+
+    switch (ps->tr[j]) {
+        case TR_LOG:
+            return log(v - ps->lb[j]);
+        case TR_LOG_UB:
+            return log(ps->ub[j] - v);
+        case TR_LOGIT:
+            e = (v - ps->lb[j])/(ps->ub[j] - ps->lb[j]);
+            return log(e/(1.0 - e));
+        default:
+            return v;
+    }
+}
+
+void
+params_expand(const struct params *ps, const gsl_vector *x, double *par, double *D) {
+    /* D[k] = dpar/dx_k is the chain factor for the Jacobian and the
+       covariance. The transforms are smooth, so the residuals stay
+       differentiable up to the bounds and a parameter whose optimum
+       lies on a bound (e.g. imm = 0) approaches it instead of
+       stalling on a kink. Only a parameter pinned by lb == ub has
+       D[k] = 0 */
+    size_t k;
+
+    memcpy(par, ps->value, sizeof(double)*ps->n);
+    for (k = 0; k < ps->p; k++) {
+        size_t j = ps->idx[k];
+        double v = gsl_vector_get (x, k), e, dv = 1.0;
+        switch (ps->tr[j]) {
+            case TR_LOG:
+                e = exp(v);
+                v = ps->lb[j] + e;
+                dv = e;
+                break;
+            case TR_LOG_UB:
+                e = exp(v);
+                v = ps->ub[j] - e;
+                dv = -e;
+                break;
+            case TR_LOGIT:
+                e = 1.0/(1.0 + exp(-v));
+                v = ps->lb[j] + (ps->ub[j] - ps->lb[j])*e;
+                dv = (ps->ub[j] - ps->lb[j])*e*(1.0 - e);
+                break;
+            default:
+                if (ps->ub[j] == ps->lb[j]) {
+                    v = ps->lb[j];
+                    dv = 0.0;
+                }
         }
+        par[j] = v;
+        if (D != NULL) D[k] = dv;
     }
-    else if (p == 2) {
-        kon = gsl_vector_get (x, 0);
-        koff = gsl_vector_get (x, 1);
+}
 
-        /* Importing one of the model functions */    
-        double (*inverted_fun)();
-        inverted_fun = &invlap_2;
+/* Function model_image(...) returns the part of the Laplace image
+   that is inverted numerically at the node s: F(s) - Ps(s) for k = 0
+   and its derivative with respect to par[k - 1] otherwise.
+   Derivatives without a Laplace image come from central finite
+   differences */
+static double complex
+model_image(const struct model *mod, const double *par, size_t k, double complex s) {
+    laplace_fn L = (k == 0) ? mod->F : mod->dF[k - 1];
+    double pp[MAX_PARAMS], h;
+    double complex Fp, Fm;
+
+    if (L == NULL) {
+        memcpy(pp, par, sizeof(double)*(mod->n_kin + 2));
+        h = FD_STEP*GSL_MAX_DBL(fabs(par[k - 1]), FD_STEP);
+        pp[k - 1] = par[k - 1] + h;
+        Fp = model_image(mod, pp, 0, s);
+        pp[k - 1] = par[k - 1] - h;
+        Fm = model_image(mod, pp, 0, s);
+        return (Fp - Fm)/(2.0*h);
+    }
+    if (mod->Ps != NULL) {
+        return L(s, par) - mod->Ps(s, par, k);
+    }
+    return L(s, par);
+}
 
-        for (i = 0; i < n; i++) {
-            /* Jacobian matrix J(i,j) = dfi / dxj, */
-            /* where fi = (Yi - yi)/sigma[i],      */
-            /*       Yi = A * exp(-lambda * i) + b  */
-            /* and the xj are the parameters (A,lambda,b) */
+/* Function plugin_eval(...) calls a plugin for all m nodes. The
+   nodes are split into PLUGIN_CHUNKS batches, which run in parallel
+   with OpenMP, and the results are gathered into F[i] and
+   dF[j*m + i] */
+static int
+plugin_eval(const struct cfdap_plugin *pl, size_t np, const double *par,
+            const double complex *s, size_t m, double complex *F, double complex *dF) {
+    size_t b;
+    int status = 0;
+
+    #pragma omp parallel for schedule(dynamic) reduction(|:status)
+    for (b = 0; b < PLUGIN_CHUNKS; b++) {
+        size_t lo = b*m/PLUGIN_CHUNKS, mb = (b + 1)*m/PLUGIN_CHUNKS - lo, i, j;
+        double complex *buf;
+
+        if (mb == 0) {
+            continue;
+        }
+        buf = malloc(sizeof(double complex)*mb*(1 + np));
+        if (buf == NULL) {
+            status |= 1;
+            continue;
+        }
+        status |= (pl->eval(mb, s + lo, par, buf, (dF != NULL) ? buf + mb : NULL) != 0);
+        for (i = 0; i < mb; i++) {
+            F[lo + i] = buf[i];
+            for (j = 0; j < np && dF != NULL; j++) {
+                dF[j*m + lo + i] = buf[(1 + j)*mb + i];
+            }
+        }
+        free(buf);
+    }
+    return status ? GSL_EFAILED : GSL_SUCCESS;
+}
 
-            if (w_flag == 0) {
-                gsl_matrix_set (J, i, 0, inverted_fun(time[i], kon, koff, Df, R, m, 1));
-                gsl_matrix_set (J, i, 1, inverted_fun(time[i], kon, koff, Df, R, m, 2));
+/* Function laplace_table(...) tabulates columns c0..ncol - 1 of the
+   raw model (F for c = 0, dF/dpar_j of the free parameter
+   j = idx[c - 1] otherwise) at the m nodes of the inversion into
+   T[c*m + i]. A plugin gets PLUGIN_CHUNKS batched calls per parameter
+   set (see plugin_eval(...)), plus as many for each of the two
+   shifted parameter sets of a finite-difference column if it has no
+   gradients */
+static int
+laplace_table(const struct data *d, const double *par, size_t c0, size_t ncol,
+              const double complex *s, size_t m, double complex *T) {
+    const struct model *mod = d->model;
+    const struct params *ps = d->par;
+    size_t np = mod->n_kin + 2, c, i, j;
+    int status = GSL_SUCCESS;
+
+    if (mod->plugin == NULL) {
+        #pragma omp parallel for collapse(2) schedule(static)
+        for (c = c0; c < ncol; c++) {
+            for (i = 0; i < m; i++) {
+                size_t k = (c == 0) ? 0 : ps->idx[c - 1] + 1;
+                /* imm enters outside of F(s) */
+                T[c*m + i] = (k == np + 1) ? 0.0 : model_image(mod, par, k, s[i]);
             }
-            else if (w_flag == 1) {
-                gsl_matrix_set (J, i, 0, inverted_fun(time[i], kon, koff, Df, R, m, 1)/sigma[i]);
-                gsl_matrix_set (J, i, 1, inverted_fun(time[i], kon, koff, Df, R, m, 2)/sigma[i]);
+        }
+        return status;
+    }
+    else {
+        const struct cfdap_plugin *pl = mod->plugin;
+        int grad = pl->gradients && ncol > 1;
+        double pp[MAX_PARAMS], h;
+        double complex *F = malloc(sizeof(double complex)*m*(1 + np));
+        double complex *dF = F + m; /* Or F(par + h) and F(par - h) */
+
+        if (F == NULL) {
+            fprintf(stderr, "ERROR: in 'laplace_table': Out of memory.\n");
+            return GSL_ENOMEM;
+        }
+        status = plugin_eval(pl, np, par, s, m, F, grad ? dF : NULL);
+        for (c = c0; c < ncol && status == GSL_SUCCESS; c++) {
+            j = (c == 0) ? 0 : ps->idx[c - 1] + 1;
+            if (j == 0) {
+                memcpy(T + c*m, F, sizeof(double complex)*m);
+            }
+            else if (j == np + 1) {
+                for (i = 0; i < m; i++) T[c*m + i] = 0.0;
+            }
+            else if (grad) {
+                memcpy(T + c*m, dF + (j - 1)*m, sizeof(double complex)*m);
             }
             else {
-                fprintf(stderr, "ERROR: in 'model_df': Parameter w_flag is neither 0 nor 1.\n");
-                exit(1);
+                memcpy(pp, par, sizeof(double)*np);
+                h = FD_STEP*GSL_MAX_DBL(fabs(par[j - 1]), FD_STEP);
+                pp[j - 1] = par[j - 1] + h;
+                status = plugin_eval(pl, np, pp, s, m, dF, NULL);
+                pp[j - 1] = par[j - 1] - h;
+                if (status == GSL_SUCCESS) {
+                    status = plugin_eval(pl, np, pp, s, m, dF + m, NULL);
+                }
+                for (i = 0; i < m; i++) {
+                    T[c*m + i] = (dF[i] - dF[m + i])/(2.0*h);
+                }
             }
         }
+        free(F);
+        return status;
     }
-    else {
-        fprintf(stderr, "ERROR: in 'model_f': Parameter p is neither 1 nor 2.\n");
-        exit(1);
-    }
-
-    return GSL_SUCCESS;
 }
 
-int
-model_fdf(const gsl_vector * x, void *data,
-         gsl_vector * f, gsl_matrix * J) {
-    model_f (x, data, f);
-    model_df (x, data, J);
+/* Function model_column(...) returns column c of the raw model at
+   time t for models with a closed-form FDAP(t): F(t) for c = 0 and
+   dF/dpar_j(t) of the free parameter j = idx[c - 1] otherwise */
+static double
+model_column(const struct data *d, const double *par, size_t c, double t) {
+    const struct model *mod = d->model;
+    size_t j;
 
-    return GSL_SUCCESS;
+    if (c == 0) {
+        return mod->Ft(t, par, 0);
+    }
+    j = d->par->idx[c - 1];
+    if (j == mod->n_kin + 2) {
+        return 0.0; /* imm enters outside of F(s) */
+    }
+    return mod->Ft(t, par, j + 1);
 }
 
-void
-print_state (size_t iter, gsl_multifit_fdfsolver * s, size_t p) {
-    if (p == 1) {
-        printf ("iter: %3u xx = % 15.8f "
-                "|f(x)| = %g\n",
-                iter,
-                gsl_vector_get (s->x, 0),
-                gsl_blas_dnrm2 (s->f));
-    }
-    else if (p == 2) {
-        printf ("iter: %3u x = % 15.8f % 15.8f "
-                "|f(x)| = %g\n",
-                iter,
-                gsl_vector_get (s->x, 0),
-                gsl_vector_get (s->x, 1),
-                gsl_blas_dnrm2 (s->f));
+/* Function model_compute(...) evaluates FDAP(t) = imm + (1 - imm)*F(t)
+   at all n time points (unless Y is NULL) and, if dY is not NULL,
+   its derivatives with respect to the free parameters, dY[i*p + k].
+   Laplace models first tabulate every needed column at the nodes of
+   the inversion and then invert the tables at all time points;
+   both steps are spread over all cores when cFDAP is compiled with
+   OpenMP. Closed-form models are evaluated directly, and the
+   closed-form part Pt(t) of a model is added after the inversion.
+   For fullModelPDE, a single solve gives F and the
+   kon, koff and Df sensitivities, while R is differentiated by
+   finite differences in parallel solves */
+static int
+model_compute(const struct data *d, const double *par, double *Y, double *dY) {
+    const struct model *mod = d->model;
+    const struct params *ps = d->par;
+    size_t n = d->n, p = ps->p, i, c, k;
+    size_t ncol = (dY != NULL) ? 1 + p : 1;
+    size_t iDf = mod->n_kin, iR = mod->n_kin + 1, iimm = mod->n_kin + 2;
+    double imm = par[iimm];
+    int status = GSL_SUCCESS;
+
+    /* F itself is only needed for Y and for the derivative by imm */
+    size_t c0 = (Y == NULL && (dY == NULL || !ps->free[iimm])) ? 1 : 0;
+
+    double *G = malloc(sizeof(double)*n*ncol);
+    if (G == NULL) {
+        fprintf(stderr, "ERROR: in 'model_compute': Out of memory.\n");
+        return GSL_ENOMEM;
+    }
+
+    if (mod->kind == MODEL_LAPLACE && mod->Ft != NULL) {
+        #pragma omp parallel for collapse(2) schedule(dynamic)
+        for (c = c0; c < ncol; c++) {
+            for (i = 0; i < n; i++) {
+                G[c*n + i] = model_column(d, par, c, d->time[i]);
+            }
+        }
+    }
+    else if (mod->kind == MODEL_LAPLACE) {
+        size_t m = d->prec->n_int + 1;
+        double complex *s = NULL, *T;
+
+        if (d->ws != NULL) {
+            s = d->ws->nodes[d->prec - precision_schedule];
+            T = d->ws->table;
+        }
+        else {
+            s = malloc(sizeof(double complex)*m*(1 + ncol));
+            if (s == NULL) {
+                fprintf(stderr, "ERROR: in 'model_compute': Out of memory.\n");
+                free(G);
+                return GSL_ENOMEM;
+            }
+            laplace_nodes(d->prec, s);
+            T = s + m;
+        }
+        status = laplace_table(d, par, c0, ncol, s, m, T);
+
+        #pragma omp parallel for collapse(2) schedule(static)
+        for (c = c0; c < ncol; c++) {
+            for (i = 0; i < n; i++) {
+                size_t j = (c == 0) ? 0 : ps->idx[c - 1] + 1;
+                G[c*n + i] = invlap(d->time[i], T + c*m, d->prec);
+                if (mod->Pt != NULL && j != iimm + 1) {
+                    G[c*n + i] += mod->Pt(d->time[i], par, j);
+                }
+            }
+        }
+        if (d->ws == NULL) free(s);
     }
     else {
-        fprintf(stderr, "ERROR: in 'print_state': Parameter p is neither 1 nor 2.\n");
-        exit(1);
+        struct pde_params pde = *d->pde;
+        double *dF[3] = { NULL, NULL, NULL };
+        double *GR[2] = { NULL, NULL };
+        double h = 0.0;
+        int st[3] = { GSL_SUCCESS, GSL_SUCCESS, GSL_SUCCESS };
+
+        pde.dt *= d->prec->dt_scale;
+        for (k = 0; k < p && dY != NULL; k++) {
+            if (ps->idx[k] < 2) dF[ps->idx[k]] = G + (1 + k)*n;
+            else if (ps->idx[k] == iDf) dF[2] = G + (1 + k)*n;
+            else if (ps->idx[k] == iR) {
+                GR[0] = malloc(sizeof(double)*2*n);
+                if (GR[0] == NULL) {
+                    fprintf(stderr, "ERROR: in 'model_compute': Out of memory.\n");
+                    free(G);
+                    return GSL_ENOMEM;
+                }
+                GR[1] = GR[0] + n;
+                h = FD_STEP*par[iR];
+            }
+        }
+
+        #pragma omp parallel for schedule(dynamic)
+        for (c = 0; c < 3; c++) {
+            if (c == 0) {
+                st[0] = pde_solve(&pde, par[0], par[1], par[iDf], par[iR], d->time, n, G, dF);
+            }
+            else if (GR[0] != NULL) {
+                double Rc = par[iR] + ((c == 1) ? h : -h);
+                st[c] = pde_solve(&pde, par[0], par[1], par[iDf], Rc, d->time, n, GR[c - 1], NULL);
+            }
+        }
+        status = st[0] ? st[0] : (st[1] ? st[1] : st[2]);
+
+        if (GR[0] != NULL) {
+            for (k = 0; k < p; k++) {
+                if (ps->idx[k] != iR) continue;
+                for (i = 0; i < n; i++) {
+                    G[(1 + k)*n + i] = (GR[0][i] - GR[1][i])/(2.0*h);
+                }
+            }
+            free(GR[0]);
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        if (Y != NULL) Y[i] = imm + (1.0 - imm)*G[i];
+        for (k = 0; k < p && dY != NULL; k++) {
+            if (ps->idx[k] == iimm) {
+                dY[i*p + k] = 1.0 - G[i];
+            }
+            else {
+                dY[i*p + k] = (1.0 - imm)*G[(1 + k)*n + i];
+            }
+        }
+    }
+
+    free(G);
+    return status;
+}
+
+int
+cache_init(struct eval_cache *c, size_t n, size_t p) {
+    size_t k;
+
+    memset(c, 0, sizeof(*c));
+    for (k = 0; k < CACHE_SIZE; k++) {
+        c->e[k].Y = malloc(sizeof(double)*n);
+        c->e[k].dY = malloc(sizeof(double)*n*p);
+        if (c->e[k].Y == NULL || c->e[k].dY == NULL) {
+            fprintf(stderr, "ERROR: in 'cache_init': Out of memory.\n");
+            cache_free(c);
+            memset(c, 0, sizeof(*c));
+            return GSL_ENOMEM;
+        }
+    }
+    return GSL_SUCCESS;
+}
+
+void
+cache_reset(struct eval_cache *c) {
+    size_t k;
+
+    c->clock = 0;
+    c->hits_f = c->misses_f = c->hits_df = c->misses_df = 0;
+    for (k = 0; k < CACHE_SIZE; k++) {
+        c->e[k].used = 0;
+        c->e[k].has_Y = c->e[k].has_dY = 0;
+    }
+}
+
+void
+cache_free(struct eval_cache *c) {
+    size_t k;
+
+    for (k = 0; k < CACHE_SIZE; k++) {
+        free(c->e[k].Y);
+        free(c->e[k].dY);
+    }
+}
+
+/* Function model_eval(...) is model_compute(...) behind the cache of
+   the fit. GSL evaluates the model several times at the same point
+   (the solver set-up after a change of the precision level, the
+   Jacobian for the covariance, the best fit), and each of these
+   evaluations costs n*(1 + p) inversions. Only the parts missing
+   from the cache are computed; failed evaluations are not stored */
+int
+model_eval(const struct data *d, const double *par, double *Y, double *dY) {
+    struct eval_cache *c = (d->ws != NULL) ? &d->ws->cache : NULL;
+    struct cache_entry *e = NULL;
+    size_t n = d->n, p = d->par->p, k;
+    int status;
+
+    if (c == NULL) {
+        return model_compute(d, par, Y, dY);
+    }
+    for (k = 0; k < CACHE_SIZE; k++) {
+        if ((c->e[k].has_Y || c->e[k].has_dY) && c->e[k].prec == d->prec &&
+            memcmp(c->e[k].par, par, sizeof(double)*d->par->n) == 0) {
+            e = &c->e[k];
+            break;
+        }
+    }
+    if (e == NULL) {
+        e = &c->e[0];
+        for (k = 1; k < CACHE_SIZE; k++) {
+            if (c->e[k].used < e->used) e = &c->e[k];
+        }
+        e->has_Y = e->has_dY = 0;
+        e->prec = d->prec;
+        memcpy(e->par, par, sizeof(double)*d->par->n);
+    }
+    e->used = ++c->clock;
+
+    if (Y != NULL) {
+        if (e->has_Y) c->hits_f++; else c->misses_f++;
+    }
+    if (dY != NULL) {
+        if (e->has_dY) c->hits_df++; else c->misses_df++;
+    }
+    if ((Y != NULL && !e->has_Y) || (dY != NULL && !e->has_dY)) {
+        status = model_compute(d, par, (Y != NULL && !e->has_Y) ? e->Y : NULL,
+                               (dY != NULL && !e->has_dY) ? e->dY : NULL);
+        if (status) {
+            e->has_Y = e->has_dY = 0;
+            return status;
+        }
+        if (Y != NULL) e->has_Y = 1;
+        if (dY != NULL) e->has_dY = 1;
+    }
+
+    if (Y != NULL) memcpy(Y, e->Y, sizeof(double)*n);
+    if (dY != NULL) memcpy(dY, e->dY, sizeof(double)*n*p);
+    return GSL_SUCCESS;
+}
+
+int
+model_f (const gsl_vector * x, void *data, 
+        gsl_vector * f) {
+    size_t n = ((struct data *)data)->n;
+    double *y = ((struct data *)data)->y;
+    double *sigma = ((struct data *) data)->sigma;
+    size_t w_flag = ((struct data *)data)->w_flag;
+
+    size_t i;
+    int status;
+    double par[MAX_PARAMS];
+
+    /* On the heap, n comes from the user (or a server request) and the
+       workers of the server run on small stacks */
+    double *Y = malloc(sizeof(double)*n);
+    if (Y == NULL) {
+        fprintf(stderr, "ERROR: in 'model_f': Out of memory.\n");
+        return GSL_ENOMEM;
+    }
+    params_expand(((struct data *)data)->par, x, par, NULL);
+    status = model_eval((struct data *)data, par, Y, NULL);
+    if (status) {
+        free(Y);
+        return status;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (w_flag == 0) {
+            gsl_vector_set (f, i, (Y[i] - y[i]));
+        }
+        else if (w_flag == 1) {
+            gsl_vector_set (f, i, (Y[i] - y[i])/sigma[i]);
+        }
+        else {
+            fprintf(stderr, "ERROR: in 'model_f': Parameter w_flag is neither 0 nor 1.\n");
+            exit(1);
+        }
+    }
+
+    free(Y);
+    return GSL_SUCCESS;
+}
+
+int
+model_df(const gsl_vector * x, void *data,
+        gsl_matrix * J) {
+    size_t n = ((struct data *)data)->n;
+    double *sigma = ((struct data *) data)->sigma;
+    size_t p = ((struct data *)data)->par->p;
+    size_t w_flag = ((struct data *)data)->w_flag;
+
+    size_t i, k;
+    int status;
+    double par[MAX_PARAMS], D[MAX_PARAMS];
+
+    double *dY = malloc(sizeof(double)*n*p);
+    if (dY == NULL) {
+        fprintf(stderr, "ERROR: in 'model_df': Out of memory.\n");
+        return GSL_ENOMEM;
+    }
+    params_expand(((struct data *)data)->par, x, par, D);
+    status = model_eval((struct data *)data, par, NULL, dY);
+    if (status) {
+        free(dY);
+        return status;
+    }
+
+    for (i = 0; i < n; i++) {
+        /* Jacobian matrix J(i,j) = dfi / dxj, */
+        /* where fi = (Yi - yi)/sigma[i]       */
+        for (k = 0; k < p; k++) {
+            double Jik = D[k]*dY[i*p + k];
+            if (w_flag == 0) {
+                gsl_matrix_set (J, i, k, Jik);
+            }
+            else if (w_flag == 1) {
+                gsl_matrix_set (J, i, k, Jik/sigma[i]);
+            }
+            else {
+                fprintf(stderr, "ERROR: in 'model_df': Parameter w_flag is neither 0 nor 1.\n");
+                exit(1);
+            }
+        }
+    }
+
+    free(dY);
+    return GSL_SUCCESS;
+}
+
+int
+model_fdf(const gsl_vector * x, void *data,
+         gsl_vector * f, gsl_matrix * J) {
+    int status = model_f (x, data, f);
+
+    if (status) {
+        return status;
+    }
+    return model_df (x, data, J);
+}
+
+void
+print_state (size_t iter, gsl_multifit_fdfsolver * s, size_t p) {
+    size_t k;
+
+    printf ("iter: %3zu x =", iter);
+    for (k = 0; k < p; k++) {
+        printf (" % 15.8f", gsl_vector_get (s->x, k));
+    }
+    printf (" |f(x)| = %g\n", gsl_blas_dnrm2 (s->f));
+}
+
+/* Functions write_result_csv(...) and write_result_bin(...) append
+   one fit to a results file that is shared by all fits of a batch
+   (print_result_csv(...) formats a CSV row for any stream). A row is
+   assembled in a large stream buffer and reaches the file in a
+   single write, so that many fits produce one file instead of two
+   small files each. An empty file first gets a header describing
+   the columns (see results_schema(...)), and a fit is only appended
+   to a file whose header it matches, so that fits with other
+   parameters or with and without curves never share one. The file
+   stays locked (fcntl, which NFS honours as well) from the header
+   check until the row is flushed, so that separate processes can
+   append to the same file.
+
+   The CSV row holds the id, model, status, iterations, chisq/dof,
+   then fit/error/conf95/conf975/conf99 for every parameter, the
+   bound fraction and its error, followed by the best-fit curve if
+   it was requested.
+
+   The binary file starts with RESULTS_MAGIC, a uint32 version and
+   a uint32 byte-order mark 0x01020304 (values are in native byte
+   order), the uint32 number of parameters p and curve points
+   n_curve and the p parameter names as char[RESULTS_NAME]. The
+   records that follow have the same size: char id[80],
+   char model[80], int32 status, uint32 iter, uint32 n, the doubles
+   chisq/dof, 5 per parameter as in the CSV row, bound, bound error
+   and n_curve points of the best fit. Records are appended as they
+   come, but as they are fixed-size and packed, the file reads as a
+   table, e.g. with numpy.fromfile(...) and a structured dtype,
+   whose columns can be taken out one by one. */
+static void
+print_result_header(FILE *out, const struct fit_result *r) {
+    size_t i, k;
+
+    fprintf(out, "id,model,status,iter,chisq_dof");
+    for (k = 0; k < r->p; k++) {
+        const char *pn = r->names[k];
+        fprintf(out, ",%s_fit,%s_error,%s_conf95,%s_conf975,%s_conf99", pn, pn, pn, pn, pn);
+    }
+    fprintf(out, ",bound,bound_error");
+    if (r->curve != NULL) {
+        for (i = 0; i < r->n; i++) {
+            fprintf(out, ",fit_%zu", i);
+        }
+    }
+    fprintf(out, "\n");
+}
+
+/* Function results_schema(...) returns the header of a results file
+   for the fit r, the CSV header line or the binary file header, to
+   be freed by the caller */
+static char *
+results_schema(const struct fit_result *r, int bin, size_t *size) {
+    char *schema = NULL;
+    FILE *out = open_memstream(&schema, size);
+
+    if (out == NULL) {
+        return NULL;
     }
+    if (bin) {
+        uint32_t version = RESULTS_VERSION, bom = 0x01020304, p = r->p;
+        uint32_t n_curve = (r->curve != NULL) ? r->n : 0;
+        size_t k;
+
+        fwrite(RESULTS_MAGIC, 1, 8, out);
+        fwrite(&version, sizeof(version), 1, out);
+        fwrite(&bom, sizeof(bom), 1, out);
+        fwrite(&p, sizeof(p), 1, out);
+        fwrite(&n_curve, sizeof(n_curve), 1, out);
+        for (k = 0; k < r->p; k++) {
+            char pn[RESULTS_NAME];
+            memset(pn, 0, sizeof(pn));
+            strncpy(pn, r->names[k], sizeof(pn) - 1);
+            fwrite(pn, 1, sizeof(pn), out);
+        }
+    }
+    else {
+        print_result_header(out, r);
+    }
+    if (fclose(out) != 0) {
+        free(schema);
+        return NULL;
+    }
+    return schema;
+}
+
+/* Function open_results(...) opens and locks a results file for
+   appending the fit r, the lock is released when the file is closed.
+   An empty file gets the header, otherwise the header of the file
+   must be that of r */
+static FILE *
+open_results(const char *name, const struct fit_result *r, int bin) {
+    size_t size;
+    char *schema = results_schema(r, bin, &size), *head;
+    FILE *out = fopen(name, bin ? "a+b" : "a+");
+    struct flock lock;
+
+    if (out == NULL || schema == NULL) {
+        fprintf(stderr, "ERROR: results file '%s' cannot be opened.\n", name);
+        if (out != NULL) fclose(out);
+        free(schema);
+        return NULL;
+    }
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    while (fcntl(fileno(out), F_SETLKW, &lock) == -1) {
+        if (errno != EINTR) {
+            fprintf(stderr, "ERROR: results file '%s' cannot be locked.\n", name);
+            fclose(out);
+            free(schema);
+            return NULL;
+        }
+    }
+    setvbuf(out, NULL, _IOFBF, RESULTS_BUFFER);
+    fseek(out, 0, SEEK_END);
+    if (ftell(out) == 0) {
+        fwrite(schema, 1, size, out);
+        free(schema);
+        return out;
+    }
+
+    /* The file already holds fits, they must have the same columns */
+    head = malloc(size);
+    rewind(out);
+    if (head == NULL || fread(head, 1, size, out) != size || memcmp(head, schema, size) != 0) {
+        fprintf(stderr, "ERROR: results file '%s' holds fits with other columns "
+                "(parameters, curves or format) than the fit of %s.\n", name, r->id);
+        free(head);
+        free(schema);
+        fclose(out);
+        return NULL;
+    }
+    free(head);
+    free(schema);
+    fseek(out, 0, SEEK_END);
+
+    return out;
+}
+
+void
+print_result_csv(FILE *out, const struct fit_result *r, int header) {
+    size_t i, k;
+
+    if (header) {
+        print_result_header(out, r);
+    }
+
+    fprintf(out, "%s,%s,%d,%zu,%g", r->id, r->m, r->status, r->iter, r->chisq_dof);
+    for (k = 0; k < r->p; k++) {
+        fprintf(out, ",%.5f,%.5f,%.5f,%.5f,%.5f", r->fit[k], r->err[k],
+                r->conf[k][0], r->conf[k][1], r->conf[k][2]);
+    }
+    fprintf(out, ",%.5f,%.5f", r->bound, r->bound_err);
+    if (r->curve != NULL) {
+        for (i = 0; i < r->n; i++) {
+            fprintf(out, ",%f", r->curve[i]);
+        }
+    }
+    fprintf(out, "\n");
+}
+
+int
+write_result_csv(const char *name, const struct fit_result *r) {
+    FILE *out = open_results(name, r, 0);
+
+    if (out == NULL) {
+        return GSL_EFAILED;
+    }
+    print_result_csv(out, r, 0);
+
+    return (fclose(out) == 0) ? GSL_SUCCESS : GSL_EFAILED;
+}
+
+int
+write_result_bin(const char *name, const struct fit_result *r) {
+    size_t k;
+    char id[80], model[80];
+    int32_t status = r->status;
+    uint32_t iter = r->iter, n = r->n;
+    FILE *out = open_results(name, r, 1);
+
+    if (out == NULL) {
+        return GSL_EFAILED;
+    }
+
+    memset(id, 0, sizeof(id));
+    memset(model, 0, sizeof(model));
+    strncpy(id, r->id, sizeof(id) - 1);
+    strncpy(model, r->m, sizeof(model) - 1);
+
+    fwrite(id, 1, sizeof(id), out);
+    fwrite(model, 1, sizeof(model), out);
+    fwrite(&status, sizeof(status), 1, out);
+    fwrite(&iter, sizeof(iter), 1, out);
+    fwrite(&n, sizeof(n), 1, out);
+    fwrite(&r->chisq_dof, sizeof(double), 1, out);
+    for (k = 0; k < r->p; k++) {
+        fwrite(&r->fit[k], sizeof(double), 1, out);
+        fwrite(&r->err[k], sizeof(double), 1, out);
+        fwrite(r->conf[k], sizeof(double), 3, out);
+    }
+    fwrite(&r->bound, sizeof(double), 1, out);
+    fwrite(&r->bound_err, sizeof(double), 1, out);
+    if (r->curve != NULL) {
+        fwrite(r->curve, sizeof(double), r->n, out);
+    }
+
+    return (fclose(out) == 0) ? GSL_SUCCESS : GSL_EFAILED;
 }
 
 void
@@ -468,11 +1827,20 @@ bad_input(void) {
     fprintf(stderr, "             [-r2 half_activation_area] [-tini initial_time]\n");
     fprintf(stderr, "             [-tend end_time] [-n numsteps]\n");
     fprintf(stderr, "             [-kon0 initial_kon] [-koff0 initial_koff]\n");
-    fprintf(stderr, "             [-x0 initial_x] [-w weights] [-i input]\n");
-    fprintf(stderr, "             [-sd standard_deviation] [-o output]\n\n");
+    fprintf(stderr, "             [-x0 initial_x] [-imm immobile_fraction]\n");
+    fprintf(stderr, "             [-free name] [-fix name] [-lb name value] [-ub name value]\n");
+    fprintf(stderr, "             [-w weights] [-i input]\n");
+    fprintf(stderr, "             [-sd standard_deviation] [-o output]\n");
+    fprintf(stderr, "             [-L domain_half_length] [-bc boundary] [-nx cells]\n");
+    fprintf(stderr, "             [-dt time_step] [-ip initial_profile]\n");
+    fprintf(stderr, "             [-rf results_file] [-rfmt format] [-curves] [-q] [-cf]\n");
+    fprintf(stderr, "             [-tr transform] [-dec mode] [-nb bins] [-deccheck]\n");
+    fprintf(stderr, "             [-batch list]\n");
+    fprintf(stderr, "       cFDAP -server socket_path [-threads n]\n\n");
     fprintf(stderr, "  model_type:             reaction-diffusion model to fit with (mandatory parameter):\n");
     fprintf(stderr, "                          fullModel, hybridModel, reactionDominantPure\n");
-    fprintf(stderr, "                          effectiveDiffusion\n");
+    fprintf(stderr, "                          effectiveDiffusion, fullModelPDE, or the path of a\n");
+    fprintf(stderr, "                          model plugin (containing '/', e.g. ./myModel.so)\n");
     fprintf(stderr, "  diffusion_constant:     diffusion constant of unbound proteins (default: 11.0 µm2/s)\n");
     fprintf(stderr, "  half_activation_area:   half length of the activation area (default: 3.0 µm)\n");
     fprintf(stderr, "  initial_time:           initial time in the curve duration range (default: 0.0 s)\n");
@@ -482,12 +1850,42 @@ bad_input(void) {
     fprintf(stderr, "                          IMPORTANT: use this parameter only with effectiveDiffusion\n");
     fprintf(stderr, "  initial_kon:            starting value for kon (default: 0.5)\n");
     fprintf(stderr, "  initial_koff:           starting value for koff (default: 0.5)\n");
+    fprintf(stderr, "  immobile_fraction:      (starting) value for the immobile fraction imm (default: 0.0)\n");
+    fprintf(stderr, "  name:                   parameter to fit (-free) or keep fixed (-fix): x, kon, koff,\n");
+    fprintf(stderr, "                          Df, R or imm. By default, only x or kon and koff are fitted.\n");
+    fprintf(stderr, "                          -lb and -ub bound a parameter from below and above\n");
     fprintf(stderr, "  weights:                whether to use weiths (0 - no, 1 - yes, default: no)\n");
     fprintf(stderr, "  input:                  name of input curve file (mandatory)\n");
     fprintf(stderr, "  standard_error:         name of input SD file (mandatory if weights = yes)\n");
     fprintf(stderr, "  output:                 prefix name of output file (Example: -o tau441wt\n");
     fprintf(stderr, "                          makes cFDAP output 'tau441wt_fit_parameters.dat'\n");
     fprintf(stderr, "                          and 'tau441wt_fit_curve.dat')\n");
+    fprintf(stderr, "  domain_half_length:     half length of the simulated domain, fullModelPDE only\n");
+    fprintf(stderr, "                          (default: R + 4*sqrt(Df*t_end))\n");
+    fprintf(stderr, "  boundary:               far boundary of the domain (0 - open, 1 - closed, default: open)\n");
+    fprintf(stderr, "  cells:                  grid cells per half activation area (default: 10)\n");
+    fprintf(stderr, "  time_step:              time step of the PDE solver (default: 0.02 s)\n");
+    fprintf(stderr, "  initial_profile:        file with 'x intensity' pairs, x measured from the center\n");
+    fprintf(stderr, "                          of the activation area (default: uniform in [-R, R])\n");
+    fprintf(stderr, "  results_file:           append one row per fit to this file; -o becomes optional\n");
+    fprintf(stderr, "  format:                 format of the results file (csv or bin, default: csv)\n");
+    fprintf(stderr, "  -curves:                also store the best fit curve in the results file\n");
+    fprintf(stderr, "  -q:                     quiet mode, no per-iteration output\n");
+    fprintf(stderr, "  -cf:                    coarse-to-fine mode, early iterations use a cheaper inversion\n");
+    fprintf(stderr, "  transform:              none - fit unbounded parameters as they are (default), log -\n");
+    fprintf(stderr, "                          also keep rates, Df and R positive. Bounded parameters are\n");
+    fprintf(stderr, "                          always fitted as log(value - lb), or the logit for two bounds\n");
+    fprintf(stderr, "  mode:                   none - fit every time point (default), log - average the curve\n");
+    fprintf(stderr, "                          in log-spaced bins, curv - in bins that are narrow where the\n");
+    fprintf(stderr, "                          curve bends. Errors stay those of the full curve\n");
+    fprintf(stderr, "  bins:                   number of bins (default: 30)\n");
+    fprintf(stderr, "  -deccheck:              also fit all points, report the speedup and the deviation\n");
+    fprintf(stderr, "  list:                   file with one 'curve_file [std_file]' per line; all curves are\n");
+    fprintf(stderr, "                          fitted into the results file, each starting from the fit of\n");
+    fprintf(stderr, "                          the most similar curve fitted before (replaces -i, -sd, -o)\n");
+    fprintf(stderr, "  socket_path:            serve fits on this Unix socket with n workers (default: one\n");
+    fprintf(stderr, "                          per core). A request is '<length>\\n<options>\\n<values>',\n");
+    fprintf(stderr, "                          the values being the curve (and the SD with -w 1)\n");
     fprintf(stderr, "\n\n");
     exit(1);
 }
@@ -496,64 +1894,75 @@ bad_input(void) {
 /**********************************************************************/
 /**********************************************************************/
 
-/* MAIN */
-int
-main(int argc, char *argv[]) {
+/* Function config_error(...) stores an error message of
+   parse_options(...) in the configuration and returns 1 */
+static int
+config_error(struct fit_config *cfg, const char *format, ...) {
+    va_list args;
 
-    int i, status;
-    unsigned int iter = 0;
-    double chi, chi0;
+    va_start(args, format);
+    vsnprintf(cfg->error, sizeof(cfg->error), format, args);
+    va_end(args);
+    return 1;
+}
+
+/* Function parse_options(...) turns the command line (or the options
+   of a server request) into a fit configuration and checks it. It
+   returns 0 on success, 1 on an error and 2 on an illegal option,
+   after which the usage is shown; the message is in cfg->error.
+   Without "server", the curve must come from a file and the result
+   must go to one. On success, the caller frees cfg->pde.profile */
+int
+parse_options(int argc, char *argv[], struct fit_config *cfg, int server) {
+    int i, ip;
+    size_t k, p;
 
     /* DEFAULTS */
-    char m[80];
-    char weights_name[1], curve_name[80], std_name[80], output_prefix[80];
-    curve_name[0] = 0; std_name[0] = 0; output_prefix[0] = 0;
-    size_t p;
+    const struct model *mod;
+    struct params ps;
     size_t w_flag = DEFAULT_FLAG_WEIGHT;
     size_t n = DEFAULT_N;
     double Df = DEFAULT_DF, R = DEFAULT_R;
     double t_ini = DEFAULT_T_INI, t_end = DEFAULT_T_END;
-    double x_init_1[1] = { DEFAULT_XX_INIT };
-    double x_init_2[2] = { DEFAULT_KON_INIT, DEFAULT_KOFF_INIT };
-
-    fprintf(stderr, "\n");
-    fprintf(stderr, "  --------------   cFDAP 0.1.0 (C) 2015\n");
-    fprintf(stderr, "  |*    cFDAP  |   Author: Maxim Igaev\n");
-    fprintf(stderr, "  | *          |   cFDAP is a fitting program for FDAP data\n");
-    fprintf(stderr, "  |  ***       |   http://www.neurobiologie.uni-osnabrueck.de/\n");
-    fprintf(stderr, "  |     *******|   https://github.com/moozzz\n");
-    fprintf(stderr, "  --------------   Email: max_igaev@yahoo.com\n");
-    fprintf(stderr, "\n");
-
-    if ((argc < 2) || (argc > 25)) {
-        bad_input();
-    }
+    char profile_name[80];
+    struct pde_params pde = { 0.0, DEFAULT_PDE_DT, DEFAULT_PDE_NX, DEFAULT_PDE_BC, NULL, 0 };
+    int results_bin = 0, with_curves = 0, quiet = server ? 2 : 0;
+    int continuation = DEFAULT_FLAG_CONTINUATION;
+    int transform = DEFAULT_FLAG_TRANSFORM;
+    enum decimation dec = DEFAULT_DECIMATION;
+    size_t n_bins = DEFAULT_BINS;
+    int dec_check = 0;
+
+    memset(cfg, 0, sizeof(*cfg));
+    profile_name[0] = 0;
 
     /* First, a model must be chosen */
+    if (argc < 2) {
+        return config_error(cfg, "ERROR: First, a model must be chosen.\n\n");
+    }
     if(strcmp(argv[1], "-m") != 0) {
-        fprintf(stderr, "ERROR: First, a model must be chosen.\n\n");
-        exit(1);
+        return config_error(cfg, "ERROR: First, a model must be chosen.\n\n");
     }
     else {
         if(argc == 2) {
-            fprintf(stderr, "ERROR: Specify the model's name.\n\n");
-            exit(1);
+            return config_error(cfg, "ERROR: Specify the model's name.\n\n");
         }
         else {
-            if(strcmp(argv[2], "fullModel") == 0 ||
-               strcmp(argv[2], "hybridModel") == 0 ||
-               strcmp(argv[2], "reactionDominantPure") == 0) {
-                strcpy(m, argv[2]);
-                p = 2;
+            mod = find_model(argv[2]);
+            if(mod == NULL && strchr(argv[2], '/') != NULL) {
+                /* A request must not make the server load code */
+                if (server) {
+                    return config_error(cfg, "ERROR: Plugins cannot be loaded by server requests.\n\n");
+                }
+                mod = load_plugin(argv[2], cfg->error, sizeof(cfg->error));
+                if (mod == NULL) {
+                    return 1;
+                }
             }
-            else if(strcmp(argv[2], "effectiveDiffusion") == 0) {
-                    strcpy(m, argv[2]);
-                p = 1;
-            }
-            else {
-                fprintf(stderr, "ERROR: Unknown model '%s'\n\n", argv[2]);
-                exit(1);
+            if(mod == NULL) {
+                return config_error(cfg, "ERROR: Unknown model '%s'\n\n", argv[2]);
             }
+            params_init(&ps, mod, Df, R);
         }
     }
 
@@ -561,362 +1970,1658 @@ main(int argc, char *argv[]) {
     for(i = 2; i < argc; i++) {
         if(strcmp(argv[i], "-d") == 0) {
             if(i == argc - 1) {
-                fprintf(stderr, "ERROR: Missing diffusion coefficient.\n\n");
-                exit(1);
+                return config_error(cfg, "ERROR: Missing diffusion coefficient.\n\n");
             }
             Df = atof(argv[i + 1]);
             i++;
             if(Df <= 0.0) {
-                fprintf(stderr, "ERROR: Would a zero or negative diffusion constant make sense?\n\n");  
-                exit(1);
+                return config_error(cfg, "ERROR: Would a zero or negative diffusion constant make sense?\n\n");
             }
         }
         else if(strcmp(argv[i], "-r2") == 0) {
             if(i == argc - 1) {
-                fprintf(stderr, "ERROR: Missing half area size.\n\n");
-                exit(1);
+                return config_error(cfg, "ERROR: Missing half area size.\n\n");
             }
             R = atof(argv[i + 1]);
             i++;
             if(R <= 0.0) {
-                fprintf(stderr, "ERROR: Would a zero or negative half area size make sense?\n\n");
-                exit(1);
+                return config_error(cfg, "ERROR: Would a zero or negative half area size make sense?\n\n");
             }
         }
         else if(strcmp(argv[i], "-x0") == 0) {
-            if(p != 1) {
-                fprintf(stderr, "ERROR: The model you chose has two fit parameters.\n\n");
-                exit(1);
+            if((ip = param_index(&ps, "x")) < 0) {
+                return config_error(cfg, "ERROR: The model you chose has no parameter x.\n\n");
             }
             if(i == argc - 1) {
-                fprintf(stderr, "ERROR: Missing initial value for x0.\n\n");
-                exit(1);
+                return config_error(cfg, "ERROR: Missing initial value for x0.\n\n");
             }
-            x_init_1[0] = atof(argv[i + 1]);
+            ps.value[ip] = atof(argv[i + 1]);
             i++;
-            if(x_init_1[0] < 0.0) {
-                fprintf(stderr, "ERROR: Would a negative x = kon/koff make sense?\n\n");
-                exit(1);
+            if(ps.value[ip] < 0.0) {
+                return config_error(cfg, "ERROR: Would a negative x = kon/koff make sense?\n\n");
             }
         }
         else if(strcmp(argv[i], "-kon0") == 0) {
-            if(p != 2) {
-                fprintf(stderr, "ERROR: The model you chose has one fit parameter.\n\n");
-                exit(1);
+            if((ip = param_index(&ps, "kon")) < 0) {
+                return config_error(cfg, "ERROR: The model you chose has no parameter kon.\n\n");
             }
             if(i == argc - 1) {
-                fprintf(stderr, "ERROR: Missing initial value for kon0.\n\n");
-                exit(1);
+                return config_error(cfg, "ERROR: Missing initial value for kon0.\n\n");
             }
-            x_init_2[0] = atof(argv[i + 1]);
+            ps.value[ip] = atof(argv[i + 1]);
             i++;
-            if(x_init_2[0] < 0.0) {
-                fprintf(stderr, "ERROR: Would a negative kon make sense?\n\n");
-                exit(1);
+            if(ps.value[ip] < 0.0) {
+                return config_error(cfg, "ERROR: Would a negative kon make sense?\n\n");
             }
         }
         else if(strcmp(argv[i], "-koff0") == 0) {
-            if(p != 2) {
-                fprintf(stderr, "ERROR: The model you chose has one fit parameter.\n\n");
-                exit(1);
+            if((ip = param_index(&ps, "koff")) < 0) {
+                return config_error(cfg, "ERROR: The model you chose has no parameter koff.\n\n");
             }
             if(i == argc - 1) {
-                fprintf(stderr, "ERROR: Missing initial value for koff0.\n\n");
-                exit(1);
+                return config_error(cfg, "ERROR: Missing initial value for koff0.\n\n");
             }
-            x_init_2[1] = atof(argv[i + 1]);
+            ps.value[ip] = atof(argv[i + 1]);
             i++;
-            if(x_init_2[1] < 0.0) {
-                fprintf(stderr, "ERROR: Would a negative koff make sense?\n\n");
-                exit(1);
+            if(ps.value[ip] < 0.0) {
+                return config_error(cfg, "ERROR: Would a negative koff make sense?\n\n");
             }
         }
         else if(strcmp(argv[i], "-tini") == 0) {
             if(i == argc - 1) {
-                fprintf(stderr, "ERROR: Missing initial time.\n\n");
-                exit(1);
+                return config_error(cfg, "ERROR: Missing initial time.\n\n");
             }
             t_ini = atof(argv[i + 1]);
             i++;
             if(t_ini < 0.0) {
-                fprintf(stderr, "ERROR: Would a negative initial time make sense?\n\n");
-                exit(1);
+                return config_error(cfg, "ERROR: Would a negative initial time make sense?\n\n");
             }
         }
         else if(strcmp(argv[i], "-tend") == 0) {
             if(i == argc - 1) {
-                fprintf(stderr, "ERROR: Missing end time.\n\n");
-                exit(1);
+                return config_error(cfg, "ERROR: Missing end time.\n\n");
             }
             t_end = atof(argv[i + 1]);
             i++;
             if(t_end < t_ini) {
-                fprintf(stderr, "ERROR: Would t_end < t_ini make sense?\n\n");
-                exit(1);
+                return config_error(cfg, "ERROR: Would t_end < t_ini make sense?\n\n");
             }
         }
         else if(strcmp(argv[i], "-n") == 0) {
             if(i == argc - 1) {
-                fprintf(stderr, "ERROR: Missing number of time points.\n\n");
-                exit(1);
+                return config_error(cfg, "ERROR: Missing number of time points.\n\n");
             }
             n = atoi(argv[i + 1]);
             i++;
             if(n < 3) {
-                fprintf(stderr, "ERROR: Your curve contatins less than 3 points? Are you kidding?\n\n");
-                exit(1);
+                return config_error(cfg, "ERROR: Your curve contatins less than 3 points? Are you kidding?\n\n");
             }
         }
         else if(strcmp(argv[i], "-w") == 0) {
             if(i == argc - 1) {
-                fprintf(stderr, "ERROR: So, are you gonna use weights or not?\n\n");
-                exit(1);
+                return config_error(cfg, "ERROR: So, are you gonna use weights or not?\n\n");
             }
             w_flag = atof(argv[i + 1]);
             i++;
             if ( !(w_flag == 0 || w_flag == 1) ) {
-                fprintf(stderr, "ERROR: -w accepts only 0 (no) or 1 (yes) as arguments.\n\n");
+                return config_error(cfg, "ERROR: -w accepts only 0 (no) or 1 (yes) as arguments.\n\n");
             }
         }
         else if(strcmp(argv[i], "-i") == 0) {
             if(i == argc - 1) {
-                fprintf(stderr, "ERROR: No input curve files given.\n\n");
-                exit(1);
+                return config_error(cfg, "ERROR: No input curve files given.\n\n");
             }
-            strcpy(curve_name, argv[i + 1]);
+            snprintf(cfg->curve_name, sizeof(cfg->curve_name), "%s", argv[i + 1]);
             i++;
         }
         else if(strcmp(argv[i], "-sd") == 0) {
             if(i == argc - 1) {
-                fprintf(stderr, "ERROR: No input SD files given.\n\n");
-                exit(1);
+                return config_error(cfg, "ERROR: No input SD files given.\n\n");
             }
-            strcpy(std_name, argv[i + 1]);
+            snprintf(cfg->std_name, sizeof(cfg->std_name), "%s", argv[i + 1]);
             i++;
         }
         else if(strcmp(argv[i], "-o") == 0) {
             if(i == argc - 1) {
-                fprintf(stderr, "ERROR: No output prefix name given.\n\n");
-                exit(1);
+                return config_error(cfg, "ERROR: No output prefix name given.\n\n");
             }
-            strcpy(output_prefix, argv[i + 1]);
+            snprintf(cfg->output_prefix, sizeof(cfg->output_prefix), "%s", argv[i + 1]);
             i++;
         }
-        else {
-            if(strncmp(argv[i], "-", 1) == 0) {
-                fprintf(stderr, "\nERROR: Illegal option %s.\n\n", argv[i]);
-                bad_input();
+        else if(strcmp(argv[i], "-L") == 0) {
+            if(i == argc - 1) {
+                return config_error(cfg, "ERROR: Missing domain half length.\n\n");
+            }
+            pde.L = atof(argv[i + 1]);
+            i++;
+            if(pde.L <= 0.0) {
+                return config_error(cfg, "ERROR: Would a zero or negative domain size make sense?\n\n");
+            }
+        }
+        else if(strcmp(argv[i], "-bc") == 0) {
+            if(i == argc - 1) {
+                return config_error(cfg, "ERROR: Missing boundary condition.\n\n");
+            }
+            pde.bc = atoi(argv[i + 1]);
+            i++;
+            if ( !(pde.bc == 0 || pde.bc == 1) ) {
+                return config_error(cfg, "ERROR: -bc accepts only 0 (open) or 1 (closed) as arguments.\n\n");
+            }
+        }
+        else if(strcmp(argv[i], "-nx") == 0) {
+            if(i == argc - 1) {
+                return config_error(cfg, "ERROR: Missing number of grid cells.\n\n");
+            }
+            pde.nx = atoi(argv[i + 1]);
+            i++;
+            if(pde.nx < 2) {
+                return config_error(cfg, "ERROR: The activation area needs at least 2 grid cells.\n\n");
+            }
+        }
+        else if(strcmp(argv[i], "-dt") == 0) {
+            if(i == argc - 1) {
+                return config_error(cfg, "ERROR: Missing time step.\n\n");
+            }
+            pde.dt = atof(argv[i + 1]);
+            i++;
+            if(pde.dt <= 0.0) {
+                return config_error(cfg, "ERROR: Would a zero or negative time step make sense?\n\n");
+            }
+        }
+        else if(strcmp(argv[i], "-imm") == 0) {
+            if(i == argc - 1) {
+                return config_error(cfg, "ERROR: Missing immobile fraction.\n\n");
+            }
+            ip = param_index(&ps, "imm");
+            ps.value[ip] = atof(argv[i + 1]);
+            i++;
+            if(ps.value[ip] < 0.0 || ps.value[ip] >= 1.0) {
+                return config_error(cfg, "ERROR: The immobile fraction must lie in [0, 1).\n\n");
+            }
+        }
+        else if(strcmp(argv[i], "-free") == 0 || strcmp(argv[i], "-fix") == 0) {
+            if(i == argc - 1) {
+                return config_error(cfg, "ERROR: Missing parameter name after %s.\n\n", argv[i]);
+            }
+            if((ip = param_index(&ps, argv[i + 1])) < 0) {
+                return config_error(cfg, "ERROR: The model you chose has no parameter %s.\n\n", argv[i + 1]);
+            }
+            ps.free[ip] = (strcmp(argv[i], "-free") == 0);
+            i++;
+        }
+        else if(strcmp(argv[i], "-lb") == 0 || strcmp(argv[i], "-ub") == 0) {
+            if(i >= argc - 2) {
+                return config_error(cfg, "ERROR: %s needs a parameter name and a value.\n\n", argv[i]);
+            }
+            if((ip = param_index(&ps, argv[i + 1])) < 0) {
+                return config_error(cfg, "ERROR: The model you chose has no parameter %s.\n\n", argv[i + 1]);
+            }
+            if(strcmp(argv[i], "-lb") == 0) {
+                ps.lb[ip] = atof(argv[i + 2]);
+            }
+            else {
+                ps.ub[ip] = atof(argv[i + 2]);
+            }
+            i += 2;
+        }
+        else if(strcmp(argv[i], "-rf") == 0) {
+            if(i == argc - 1) {
+                return config_error(cfg, "ERROR: No results file name given.\n\n");
+            }
+            snprintf(cfg->results_name, sizeof(cfg->results_name), "%s", argv[i + 1]);
+            i++;
+        }
+        else if(strcmp(argv[i], "-rfmt") == 0) {
+            if(i == argc - 1) {
+                return config_error(cfg, "ERROR: Missing results file format.\n\n");
+            }
+            if(strcmp(argv[i + 1], "csv") == 0) {
+                results_bin = 0;
+            }
+            else if(strcmp(argv[i + 1], "bin") == 0) {
+                results_bin = 1;
+            }
+            else {
+                return config_error(cfg, "ERROR: -rfmt accepts only csv or bin as arguments.\n\n");
+            }
+            i++;
+        }
+        else if(strcmp(argv[i], "-curves") == 0) {
+            with_curves = 1;
+        }
+        else if(strcmp(argv[i], "-q") == 0) {
+            quiet = GSL_MAX_INT(quiet, 1);
+        }
+        else if(strcmp(argv[i], "-cf") == 0) {
+            continuation = 1;
+        }
+        else if(strcmp(argv[i], "-tr") == 0) {
+            if(i == argc - 1) {
+                return config_error(cfg, "ERROR: Missing parameter transform.\n\n");
+            }
+            if(strcmp(argv[i + 1], "none") == 0) {
+                transform = 0;
+            }
+            else if(strcmp(argv[i + 1], "log") == 0) {
+                transform = 1;
+            }
+            else {
+                return config_error(cfg, "ERROR: -tr accepts only none or log as arguments.\n\n");
+            }
+            i++;
+        }
+        else if(strcmp(argv[i], "-dec") == 0) {
+            if(i == argc - 1) {
+                return config_error(cfg, "ERROR: Missing decimation mode.\n\n");
+            }
+            if(strcmp(argv[i + 1], "none") == 0) {
+                dec = DEC_NONE;
+            }
+            else if(strcmp(argv[i + 1], "log") == 0) {
+                dec = DEC_LOG;
+            }
+            else if(strcmp(argv[i + 1], "curv") == 0) {
+                dec = DEC_CURV;
+            }
+            else {
+                return config_error(cfg, "ERROR: -dec accepts only none, log or curv as arguments.\n\n");
+            }
+            i++;
+        }
+        else if(strcmp(argv[i], "-nb") == 0) {
+            if(i == argc - 1) {
+                return config_error(cfg, "ERROR: Missing number of bins.\n\n");
+            }
+            n_bins = atoi(argv[i + 1]);
+            i++;
+        }
+        else if(strcmp(argv[i], "-deccheck") == 0) {
+            dec_check = 1;
+        }
+        else if(strcmp(argv[i], "-batch") == 0) {
+            if(i == argc - 1) {
+                return config_error(cfg, "ERROR: No list of curves given.\n\n");
+            }
+            snprintf(cfg->batch_name, sizeof(cfg->batch_name), "%s", argv[i + 1]);
+            i++;
+        }
+        else if(strcmp(argv[i], "-ip") == 0) {
+            if(i == argc - 1) {
+                return config_error(cfg, "ERROR: No initial profile file given.\n\n");
+            }
+            if (server) {
+                return config_error(cfg, "ERROR: -ip cannot be used in server requests.\n\n");
+            }
+            snprintf(profile_name, sizeof(profile_name), "%s", argv[i + 1]);
+            i++;
+        }
+        else {
+            if(strncmp(argv[i], "-", 1) == 0) {
+                config_error(cfg, "\nERROR: Illegal option %s.\n\n", argv[i]);
+                return 2;
             }
         }
     }
-
-    /* Checking whether input and output file names were given */
-    char output_prefix_copy[80];
-    strcpy(output_prefix_copy, output_prefix);
-    if (curve_name[0] == 0 || output_prefix[0] == 0) {
-        fprintf(stderr, "ERROR: File input/output is not defined correctly.\n\n");
-        exit(1);
-    }
-
-    /* Checking whether std name was given if w_flag == 1 */
-    if (w_flag == 1 && std_name[0] == 0) {
-        fprintf(stderr, "ERROR: You want to use weighted fitting. Specify the std file.\n\n");
-        exit(1);
-    }
-
-    /* Solver initialization */
-    double time[n], y[n], sigma[n], best_fit[n];
-    double stepSize = (t_end - t_ini)/(double) (n - 1);
-    const gsl_multifit_fdfsolver_type *T = gsl_multifit_fdfsolver_lmsder;
-    
-    gsl_multifit_fdfsolver *s;
-    gsl_vector *res_f;
-    gsl_matrix *J = gsl_matrix_alloc(n, p); /* Jacobian matrix */
-    gsl_matrix *covar = gsl_matrix_alloc (p, p); /* Covariance matrix */
-
-    struct data d = { n, Df, R, time, y, sigma, m, p, w_flag };
-
-    gsl_multifit_function_fdf f;
-    gsl_vector_view x;
-    if (p == 1) {
-        x = gsl_vector_view_array (x_init_1, p);
-    }
-    else if (p == 2)
-    {
-        x = gsl_vector_view_array (x_init_2, p);
-    }
-    else {
-        fprintf(stderr, "ERROR: in main: Parameter p is neither 1 nor 2.\n");
-        exit(1);
-    }
-
-    f.f = &model_f;
-    f.df = &model_df;
-    f.fdf = &model_fdf;
-    f.n = n;
-    f.p = p;
-    f.params = &d;
-
-    /* Importing the FDAP curve to be fitted */
-    double temp;
-    FILE *input_curve = fopen(curve_name, "r");
-    printf("Opening the curve file...\n");
-    if(input_curve == NULL) {
-        fprintf(stderr, "ERROR: input_curve file cannot be opened.\n");
-        fprintf(stderr, "ERROR: Probably, cFDAP and input_curve must be in the same folder.\n");
-        exit(1);
-    }
-    for(i = 0; i < NELEMS_1D(y); i++) {
-        time[i] = t_ini + (double) i*stepSize;
-        fscanf(input_curve, "%lf", &temp);
-        y[i] = temp;
-        if (i < 5) printf("data: %f %g\n", time[i], y[i]);
+
+    /* Setting up the parameter vector */
+    ps.value[param_index(&ps, "Df")] = Df;
+    ps.value[param_index(&ps, "R")] = R;
+    params_update(&ps);
+    params_transform(&ps, transform ? mod->n_kin + 2 : 0);
+    p = ps.p;
+    if (p == 0) {
+        return config_error(cfg, "ERROR: All parameters are fixed, there is nothing to fit.\n\n");
+    }
+    if (p >= n) {
+        return config_error(cfg, "ERROR: The curve has fewer points than free parameters.\n\n");
+    }
+    if (dec != DEC_NONE && p >= n_bins) {
+        return config_error(cfg, "ERROR: The decimated curve needs more bins than free parameters.\n\n");
+    }
+    for (k = 0; k < ps.n; k++) {
+        if (ps.lb[k] > ps.ub[k] || ps.value[k] < ps.lb[k] || ps.value[k] > ps.ub[k]) {
+            return config_error(cfg, "ERROR: The value of %s lies outside of its bounds.\n\n", ps.name[k]);
+        }
+        /* A transformed parameter never reaches its bounds */
+        if (ps.free[k] && ps.tr[k] == TR_LOG && ps.value[k] == ps.lb[k]) {
+            return config_error(cfg, "ERROR: The starting value of %s must lie above %g.\n\n", ps.name[k], ps.lb[k]);
+        }
+        if (ps.free[k] && ps.tr[k] == TR_LOG_UB && ps.value[k] == ps.ub[k]) {
+            return config_error(cfg, "ERROR: The starting value of %s must lie below %g.\n\n", ps.name[k], ps.ub[k]);
+        }
+        if (ps.free[k] && ps.tr[k] == TR_LOGIT) {
+            double m = TR_MARGIN*(ps.ub[k] - ps.lb[k]);
+            ps.value[k] = GSL_MIN_DBL(GSL_MAX_DBL(ps.value[k], ps.lb[k] + m), ps.ub[k] - m);
+        }
+    }
+
+    /* Checking whether input and output file names were given, a
+       server gets the curve with the request and returns the result */
+    if (!server && cfg->batch_name[0] == 0 && (cfg->curve_name[0] == 0 || (cfg->output_prefix[0] == 0 && cfg->results_name[0] == 0))) {
+        return config_error(cfg, "ERROR: File input/output is not defined correctly.\n\n");
+    }
+
+    /* A batch takes the curves (and SD files) from its list and
+       collects all fits in the results file */
+    if (cfg->batch_name[0] != 0 && (server || cfg->results_name[0] == 0)) {
+        return config_error(cfg, "ERROR: -batch needs a results file (-rf) and no server.\n\n");
+    }
+
+    /* Checking whether std name was given if w_flag == 1 */
+    if (!server && cfg->batch_name[0] == 0 && w_flag == 1 && cfg->std_name[0] == 0) {
+        return config_error(cfg, "ERROR: You want to use weighted fitting. Specify the std file.\n\n");
+    }
+
+    /* Setting up the PDE solver */
+    if (mod->kind == MODEL_PDE) {
+        if (pde.L == 0.0) {
+            pde.L = R + DEFAULT_PDE_NSIGMA*sqrt(Df*t_end);
+        }
+        if (pde.L <= R) {
+            return config_error(cfg, "ERROR: The domain must be larger than the activation area.\n\n");
+        }
+        if (profile_name[0] != 0) {
+            double xp, ip;
+            size_t n_alloc = 64;
+            FILE *input_profile = fopen(profile_name, "r");
+            if (quiet < 2) printf("Opening the initial profile file...\n");
+            if(input_profile == NULL) {
+                return config_error(cfg, "ERROR: initial_profile file cannot be opened.\n");
+            }
+            pde.profile = malloc(sizeof(double)*2*n_alloc);
+            if (pde.profile == NULL) {
+                fclose(input_profile);
+                return config_error(cfg, "ERROR: in 'parse_options': Out of memory.\n");
+            }
+            while (fscanf(input_profile, "%lf %lf", &xp, &ip) == 2) {
+                if (pde.n_profile > 0 && xp <= pde.profile[2*pde.n_profile - 2]) {
+                    fclose(input_profile);
+                    free(pde.profile);
+                    return config_error(cfg, "ERROR: x in the initial profile must be increasing.\n");
+                }
+                if (pde.n_profile == n_alloc) {
+                    double *more = realloc(pde.profile, sizeof(double)*4*n_alloc);
+                    if (more == NULL) {
+                        fclose(input_profile);
+                        free(pde.profile);
+                        return config_error(cfg, "ERROR: in 'parse_options': Out of memory.\n");
+                    }
+                    pde.profile = more;
+                    n_alloc *= 2;
+                }
+                pde.profile[2*pde.n_profile] = xp;
+                pde.profile[2*pde.n_profile + 1] = ip;
+                pde.n_profile++;
+            }
+            fclose(input_profile);
+            if (pde.n_profile < 2) {
+                free(pde.profile);
+                return config_error(cfg, "ERROR: The initial profile needs at least 2 points.\n");
+            }
+            if (quiet < 2) printf("Initial profile has been successfully read in (%zu points).\n\n", pde.n_profile);
+        }
+        if (quiet < 2) printf("PDE grid: L = %g, dx = %g, dt = %g, %s boundary\n\n",
+               pde.L, R/(double) pde.nx, pde.dt, (pde.bc == 0) ? "open" : "closed");
+    }
+
+    cfg->mod = mod;
+    cfg->ps = ps;
+    cfg->n = n;
+    cfg->w_flag = w_flag;
+    cfg->Df = Df;
+    cfg->R = R;
+    cfg->t_ini = t_ini;
+    cfg->t_end = t_end;
+    cfg->pde = pde;
+    cfg->results_bin = results_bin;
+    cfg->with_curves = with_curves;
+    cfg->quiet = quiet;
+    cfg->continuation = continuation;
+    cfg->dec = dec;
+    cfg->n_bins = GSL_MIN(n_bins, n);
+    cfg->dec_check = dec_check && dec != DEC_NONE;
+    return 0;
+}
+
+/* Function fit_time_grid(...) returns the time points of a curve */
+void
+fit_time_grid(const struct fit_config *cfg, double *time) {
+    size_t i;
+    double stepSize = (cfg->t_end - cfg->t_ini)/(double) (cfg->n - 1);
+
+    for (i = 0; i < cfg->n; i++) {
+        time[i] = cfg->t_ini + (double) i*stepSize;
     }
     if(time[0] == 0.0) time[0] = 0.01;
-    printf("Curve file has been successfully read in.\n\n");
-    fclose(input_curve);
+}
 
-    /* Importing the errors for the FDAP curve if w_flag == 1 */
-    if (w_flag == 1) {
-        FILE *error_curve = fopen(std_name, "r");
-        printf("Opening the error file...\n");
-        if(error_curve == NULL) {
-            fprintf(stderr, "ERROR: error_curve file cannot be opened.\n");
-            fprintf(stderr, "ERROR: Probably, cFDAP and error_curve must be in the same folder.\n");
+/* Function decimate(...) averages the curve in cfg->n_bins bins of
+   consecutive time points and returns the number of bins. With
+   DEC_LOG, bin edges are spaced logarithmically, so that the fast
+   early decay keeps single points and the flat tail is merged. With
+   DEC_CURV, the density of edges follows sqrt(|y''|) of the smoothed
+   curve (the optimal knot density of a piecewise linear fit), plus a
+   floor that keeps flat parts from collapsing into one bin.
+   Within a bin, points are weighted with w = 1/sigma^2 (w = 1 for
+   unweighted fits), giving tb = sum(w*t)/W, yb = sum(w*y)/W and
+   sb = 1/sqrt(W), W = sum(w). Up to the curvature of the model
+   within a bin, the chi-square of the bins then differs from the
+   full one only by a constant, so the fit, its errors and its
+   confidence intervals stay the same. Returns 0 if it runs out of
+   memory */
+size_t
+decimate(const struct fit_config *cfg, const double *time, const double *y,
+         const double *sigma, double *tb, double *yb, double *sb) {
+    size_t n = cfg->n, m = cfg->n_bins, b, i, k;
+    size_t *edge = malloc(sizeof(size_t)*(m + 1));
+
+    if (edge == NULL) {
+        return 0;
+    }
+    edge[0] = 0;
+    if (cfg->dec == DEC_LOG) {
+        for (k = 1; k <= m; k++) {
+            edge[k] = (size_t) floor(pow(n + 1.0, (double) k/m) + 0.5) - 1;
+        }
+    }
+    else {
+        /* Cumulative density of the edges */
+        double *ys = malloc(sizeof(double)*2*n), *rho = ys + n, total = 0.0, cum = 0.0;
+        size_t h = GSL_MAX(1, n/(2*m));
+
+        if (ys == NULL) {
+            free(edge);
+            return 0;
+        }
+
+        /* Symmetric moving average, narrower at the ends so that the
+           early decay is not flattened */
+        for (i = 0; i < n; i++) {
+            size_t w = GSL_MIN(h, GSL_MIN(i, n - 1 - i)), j;
+            ys[i] = 0.0;
+            for (j = i - w; j <= i + w; j++) {
+                ys[i] += y[j];
+            }
+            ys[i] /= (double) (2*w + 1);
+        }
+        rho[0] = rho[n - 1] = 0.0;
+        for (i = 1; i + 1 < n; i++) {
+            rho[i] = sqrt(fabs(ys[i - 1] - 2.0*ys[i] + ys[i + 1]));
+            total += rho[i];
+        }
+        if (n > 2) {
+            rho[0] = rho[1];
+            rho[n - 1] = rho[n - 2];
+        }
+        total += rho[0] + rho[n - 1];
+        for (i = 0; i < n; i++) {
+            rho[i] += DEC_CURV_FLOOR*total/(double) n;
+        }
+        total *= 1.0 + DEC_CURV_FLOOR;
+
+        for (i = 0, k = 1; i < n && k < m; i++) {
+            cum += rho[i];
+            while (k < m && cum >= total*(double) k/m) {
+                edge[k++] = i + 1;
+            }
+        }
+        for (; k <= m; k++) {
+            edge[k] = n;
+        }
+        free(ys);
+    }
+
+    /* Every bin holds at least one point and there are m of them */
+    for (k = 1; k <= m; k++) {
+        edge[k] = GSL_MIN(GSL_MAX(edge[k], edge[k - 1] + 1), n - (m - k));
+    }
+
+    for (b = 0; b < m; b++) {
+        double W = 0.0, wt = 0.0, wy = 0.0;
+        for (i = edge[b]; i < edge[b + 1]; i++) {
+            double w = (cfg->w_flag == 1) ? 1.0/(sigma[i]*sigma[i]) : 1.0;
+            W += w;
+            wt += w*time[i];
+            wy += w*y[i];
+        }
+        tb[b] = wt/W;
+        yb[b] = wy/W;
+        sb[b] = 1.0/sqrt(W);
+    }
+    free(edge);
+    return m;
+}
+
+/* Functions workspace_init(...), workspace_setup(...) and
+   workspace_free(...) manage a fit_workspace. The inversion nodes
+   are computed once, the solver is only reallocated when the size
+   of the fit changes, and the cache is emptied before every fit */
+void
+workspace_init(struct fit_workspace *ws) {
+    size_t k, m_max = 0;
+
+    memset(ws, 0, sizeof(*ws));
+    for (k = 0; k < N_PRECISION; k++) {
+        size_t m = precision_schedule[k].n_int + 1;
+        ws->nodes[k] = malloc(sizeof(double complex)*m);
+        if (ws->nodes[k] == NULL) {
+            fprintf(stderr, "ERROR: in 'workspace_init': Out of memory.\n");
             exit(1);
         }
-        for(i = 0; i < NELEMS_1D(y); i++) {
-            fscanf(error_curve, "%lf", &temp);
-            sigma[i] = temp;
-            if (i < 5) printf("data: %g\n", sigma[i]);
+        laplace_nodes(&precision_schedule[k], ws->nodes[k]);
+        m_max = GSL_MAX(m_max, m);
+    }
+    ws->table = malloc(sizeof(double complex)*m_max*(1 + MAX_PARAMS));
+    if (ws->table == NULL) {
+        fprintf(stderr, "ERROR: in 'workspace_init': Out of memory.\n");
+        exit(1);
+    }
+}
+
+static void
+workspace_release(struct fit_workspace *ws) {
+    if (ws->s != NULL) gsl_multifit_fdfsolver_free (ws->s);
+    if (ws->J != NULL) gsl_matrix_free (ws->J);
+    if (ws->covar != NULL) gsl_matrix_free (ws->covar);
+    cache_free(&ws->cache);
+    memset(&ws->cache, 0, sizeof(ws->cache));
+    ws->s = NULL;
+    ws->J = NULL;
+    ws->covar = NULL;
+}
+
+int
+workspace_setup(struct fit_workspace *ws, size_t n, size_t p) {
+    if (ws->s != NULL && ws->n == n && ws->p == p) {
+        cache_reset(&ws->cache);
+        return GSL_SUCCESS;
+    }
+    workspace_release(ws);
+    ws->n = n;
+    ws->p = p;
+    ws->s = gsl_multifit_fdfsolver_alloc (gsl_multifit_fdfsolver_lmsder, n, p);
+    ws->J = gsl_matrix_alloc(n, p); /* Jacobian matrix */
+    ws->covar = gsl_matrix_alloc (p, p); /* Covariance matrix */
+    if (ws->s == NULL || ws->J == NULL || ws->covar == NULL ||
+        cache_init(&ws->cache, n, p) != GSL_SUCCESS) {
+        workspace_release(ws);
+        return GSL_ENOMEM;
+    }
+    return GSL_SUCCESS;
+}
+
+void
+workspace_free(struct fit_workspace *ws) {
+    size_t k;
+
+    workspace_release(ws);
+    for (k = 0; k < N_PRECISION; k++) {
+        free(ws->nodes[k]);
+    }
+    free(ws->table);
+}
+
+/* Function run_fit(...) fits the curve y (with the standard
+   deviations sigma if cfg->w_flag == 1) at the given time points and
+   fills res and st. If best_fit is not NULL, it receives the model
+   at the fitted parameters. With cfg->dec, the fit runs on the bins
+   of decimate(...), the best fit still covers all time points.
+   Nothing but the solver progress is printed, and only if cfg->quiet
+   allows it, so that run_fit(...) can serve several fits at once,
+   each in its own workspace. If memory runs out, it returns
+   GSL_ENOMEM and res and st must not be used */
+int
+run_fit(const struct fit_config *cfg, double *time, double *y, double *sigma,
+        struct fit_workspace *ws, struct fit_result *res, struct fit_stats *st,
+        double *best_fit) {
+    size_t i, k;
+    int status;
+    unsigned int iter = 0;
+    struct params ps = cfg->ps;
+    struct pde_params pde = cfg->pde;
+    size_t n = cfg->n, p = ps.p;
+    double x_init[MAX_PARAMS], par_fit[MAX_PARAMS], D[MAX_PARAMS];
+    double *bins = NULL, chisq;
+
+    gsl_multifit_fdfsolver *s;
+    gsl_vector *res_f;
+    gsl_matrix *J, *covar;
+
+    size_t level = cfg->continuation ? 0 : N_PRECISION - 1;
+    struct timespec wall_start, wall_end;
+
+    struct data d = { n, time, y, sigma, cfg->mod, &ps, cfg->w_flag, &pde, &precision_schedule[level], ws };
+
+    gsl_multifit_function_fdf f;
+
+    /* The bins always carry their standard deviations */
+    if (cfg->dec != DEC_NONE) {
+        bins = malloc(sizeof(double)*4*n);
+        if (bins == NULL) {
+            fprintf(stderr, "ERROR: in 'run_fit': Out of memory.\n");
+            return GSL_ENOMEM;
         }
-        printf("Error file has been successfully read in.\n\n");
-        fclose(error_curve);
+        d.time = bins;
+        d.y = bins + n;
+        d.sigma = bins + 2*n;
+        d.n = decimate(cfg, time, y, sigma, d.time, d.y, d.sigma);
+        d.w_flag = 1;
+        n = d.n;
+        if (n == 0) {
+            free(bins);
+            return GSL_ENOMEM;
+        }
+    }
+
+    gsl_vector_view x;
+    for (k = 0; k < p; k++) {
+        x_init[k] = params_to_x(&ps, ps.idx[k], ps.value[ps.idx[k]]);
     }
+    x = gsl_vector_view_array (x_init, p);
+
+    f.f = &model_f;
+    f.df = &model_df;
+    f.fdf = &model_fdf;
+    f.n = n;
+    f.p = p;
+    f.params = &d;
 
     /* Allocating a new instance for the solver */
-    s = gsl_multifit_fdfsolver_alloc (T, n, p);
-    if (w_flag == 0) {
-        printf("Initializing '%s' solver with NO weights...\n\n", gsl_multifit_fdfsolver_name(s));
+    if (workspace_setup(ws, n, p) != GSL_SUCCESS) {
+        free(bins);
+        return GSL_ENOMEM;
     }
-    else {
-        printf("Initializing '%s' solver with weights...\n\n", gsl_multifit_fdfsolver_name(s));
+    memset(st, 0, sizeof(*st));
+    s = ws->s;
+    J = ws->J;
+    covar = ws->covar;
+    st->method = gsl_multifit_fdfsolver_name(s);
+    if (cfg->quiet < 2) {
+        if (cfg->dec != DEC_NONE) {
+            printf("Fitting %zu bins of %zu time points (%s spacing)\n", n, cfg->n,
+                   (cfg->dec == DEC_LOG) ? "logarithmic" : "curvature-adaptive");
+        }
+        if (cfg->w_flag == 0) {
+            printf("Initializing '%s' solver with NO weights...\n\n", gsl_multifit_fdfsolver_name(s));
+        }
+        else {
+            printf("Initializing '%s' solver with weights...\n\n", gsl_multifit_fdfsolver_name(s));
+        }
     }
 
     /* Initializing a solver with a starting point x */
+    clock_gettime(CLOCK_MONOTONIC, &wall_start);
     gsl_multifit_fdfsolver_set (s, &f, &x.vector);
 
     /* Computing the initial residual norm */
     res_f = gsl_multifit_fdfsolver_residual(s);
-    chi0 = gsl_blas_dnrm2(res_f);
+    st->chi0 = gsl_blas_dnrm2(res_f);
 
     /* Solving the system with a maximum of 500 iterations */
-    print_state (iter, s, p);
+    if (!cfg->quiet) print_state (iter, s, p);
     do {
         iter++;
         status = gsl_multifit_fdfsolver_iterate (s);
 
-        printf ("current status = %s\n", gsl_strerror (status));
-
-        print_state (iter, s, p);
+        if (!cfg->quiet) {
+            printf ("current status = %s\n", gsl_strerror (status));
+            print_state (iter, s, p);
+        }
 
-        if (status)
-            break;
+        if (status == GSL_SUCCESS) {
+            status = gsl_multifit_test_delta (s->dx, s->x, d.prec->tol, d.prec->tol);
+        }
 
-        status = gsl_multifit_test_delta (s->dx, s->x, 1e-4, 1e-4);
+        /* Moving on to a finer inversion once the current precision
+           level has converged or stopped making progress */
+        if (status != GSL_CONTINUE && level < N_PRECISION - 1) {
+            st->iter_level[level] = gsl_multifit_fdfsolver_niter(s);
+            st->nevalf += f.nevalf;
+            st->nevaldf += f.nevaldf;
+            d.prec = &precision_schedule[++level];
+            gsl_vector_memcpy (&x.vector, s->x);
+            gsl_multifit_fdfsolver_set (s, &f, &x.vector);
+            if (!cfg->quiet) printf ("precision level %zu: n_int = %d, omega = %g\n", level, d.prec->n_int, d.prec->omega);
+            status = GSL_CONTINUE;
+        }
     }
     while (status == GSL_CONTINUE && iter < 500);
 
+    /* The covariance and the best fit always need full precision */
+    if (level < N_PRECISION - 1) {
+        st->iter_level[level] = gsl_multifit_fdfsolver_niter(s);
+        st->nevalf += f.nevalf;
+        st->nevaldf += f.nevaldf;
+        level = N_PRECISION - 1;
+        d.prec = &precision_schedule[level];
+        gsl_vector_memcpy (&x.vector, s->x);
+        gsl_multifit_fdfsolver_set (s, &f, &x.vector);
+    }
+    st->iter_level[level] = gsl_multifit_fdfsolver_niter(s);
+    st->nevalf += f.nevalf;
+    st->nevaldf += f.nevaldf;
+
     /* Computing the Jacobian and covariace matrix */
     gsl_multifit_fdfsolver_jac(s, J);
     gsl_multifit_covar (J, 0.0, covar);
 
+    /* Mapping the covariance back to the parameters, C = D*C_x*D */
+    params_expand(&ps, s->x, par_fit, D);
+    for (k = 0; k < p; k++) {
+        for (i = 0; i < p; i++) {
+            gsl_matrix_set(covar, k, i, D[k]*gsl_matrix_get(covar, k, i)*D[i]);
+        }
+    }
+
     /* Computing the final residual norm */
-    chi = gsl_blas_dnrm2(res_f);
+    st->chi = gsl_blas_dnrm2(res_f);
+    clock_gettime(CLOCK_MONOTONIC, &wall_end);
     
-#define FIT(i) gsl_vector_get(s->x, i)
-#define ERR(i) sqrt(gsl_matrix_get(covar,i,i))
+#define FIT(k) par_fit[ps.idx[k]]
+#define ERR(k) sqrt(gsl_matrix_get(covar,k,k))
+
+    /* Computing the best fit, s->x has been evaluated last and is
+       still in the cache */
+    chisq = pow(st->chi, 2.0);
+    if (best_fit != NULL && cfg->dec == DEC_NONE) {
+        model_eval(&d, par_fit, best_fit, NULL);
+    }
+    else if (cfg->dec != DEC_NONE) {
+        /* A decimated fit is judged by the residuals of all points, as
+           the bins average out the noise but not a systematic misfit */
+        struct data full = d;
+        double *Y = (best_fit != NULL) ? best_fit : bins + 3*cfg->n;
+
+        full.n = cfg->n;
+        full.time = time;
+        full.ws = NULL;
+        model_eval(&full, par_fit, Y, NULL);
+        chisq = 0.0;
+        for (i = 0; i < cfg->n; i++) {
+            double r = (cfg->w_flag == 1) ? (Y[i] - y[i])/sigma[i] : Y[i] - y[i];
+            chisq += r*r;
+        }
+        n = cfg->n;
+    }
 
-    printf("\nSummary from method '%s':\n", gsl_multifit_fdfsolver_name(s));
-    printf("Number of iterations done: %zu\n", gsl_multifit_fdfsolver_niter(s));
-    printf("Function evaluations: %zu\n", f.nevalf);
-    printf("Jacobian evaluations: %zu\n", f.nevaldf);
-    printf("Initial |f(x)| = %g\n", chi0);
-    printf("Final |f(x)| = %g\n", chi);
+    st->wall = (wall_end.tv_sec - wall_start.tv_sec) + 1e-9*(wall_end.tv_nsec - wall_start.tv_nsec);
+    st->hits_f = ws->cache.hits_f;
+    st->misses_f = ws->cache.misses_f;
+    st->hits_df = ws->cache.hits_df;
+    st->misses_df = ws->cache.misses_df;
 
     {
         double dof = n - p;
-        double c = GSL_MAX_DBL(1, chi / sqrt(dof));
+        double c = GSL_MAX_DBL(1, sqrt(chisq/dof));
+        double err_par[MAX_PARAMS] = { 0.0 };
+        int ix = param_index(&ps, "x");
+        int ion = param_index(&ps, "kon"), ioff = param_index(&ps, "koff");
+
+        /* Collecting the results */
+        res->id = cfg->curve_name;
+        res->m = cfg->mod->name;
+        res->status = status;
+        res->iter = iter;
+        res->n = n;
+        res->p = p;
+        res->chisq_dof = chisq/dof;
+        for (k = 0; k < p; k++) {
+            res->names[k] = ps.name[ps.idx[k]];
+            res->fit[k] = FIT(k);
+            res->err[k] = c*ERR(k);
+            res->conf[k][0] = c*ERR(k)*gsl_cdf_tdist_Pinv(0.95, dof);
+            res->conf[k][1] = c*ERR(k)*gsl_cdf_tdist_Pinv(0.975, dof);
+            res->conf[k][2] = c*ERR(k)*gsl_cdf_tdist_Pinv(0.99, dof);
+            err_par[ps.idx[k]] = res->err[k];
+        }
+
+        /* Bound fraction from x = kon/koff or from kon and koff */
+        if (ix >= 0) {
+            res->bound = 100.0 - 100.0/(1.0 + par_fit[ix]);
+            res->bound_err = 1.0;
+        }
+        else if (ion >= 0 && ioff >= 0) {
+            double kon = par_fit[ion], koff = par_fit[ioff];
+            res->bound = 100.0 - 100.0/(1.0 + kon/koff);
+            res->bound_err = 100.0*(err_par[ion]/koff - kon*err_par[ioff]/koff/koff)/(1.0 + kon/koff)/(1.0 + kon/koff);
+        }
+        else {
+            res->bound = GSL_NAN;
+            res->bound_err = GSL_NAN;
+        }
+    }
+    res->curve = (cfg->with_curves && best_fit != NULL) ? best_fit : NULL;
 
-        printf("chisq/dof = %g\n", pow(chi, 2.0)/dof);
+#undef FIT
+#undef ERR
 
-        if (p == 1) {
-            printf ("x          = %.5f +/- %.5f\n", FIT(0), c*ERR(0));
-            printf ("x conf     = +/- %.5f %.5f %.5f\n", c*ERR(0)*gsl_cdf_tdist_Pinv(0.95, dof), c*ERR(0)*gsl_cdf_tdist_Pinv(0.975, dof), c*ERR(0)*gsl_cdf_tdist_Pinv(0.99, dof));
-            printf ("bound      = %.5f +/- %.5f\n", 100.0 - 100.0/(1.0 + FIT(0)), 1.0);
+    free(bins);
+    return status;
+}
+
+/* Functions read_full(...) and write_full(...) transfer exactly
+   "size" bytes over a socket, or fail */
+static int
+read_full(int fd, char *buf, size_t size) {
+    while (size > 0) {
+        ssize_t r = read(fd, buf, size);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        buf += r;
+        size -= r;
+    }
+    return 0;
+}
+
+static int
+write_full(int fd, const char *buf, size_t size) {
+    while (size > 0) {
+        ssize_t r = write(fd, buf, size);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        buf += r;
+        size -= r;
+    }
+    return 0;
+}
+
+/* Function read_frame(...) reads one frame, a decimal byte count and
+   a newline followed by the payload, which is returned as a
+   NUL-terminated string to be freed by the caller. It returns NULL
+   at the end of the connection or on a malformed frame */
+static char *
+read_frame(int fd) {
+    char line[32], *payload;
+    size_t k = 0, size;
+
+    while (1) {
+        if (k == sizeof(line) - 1 || read_full(fd, line + k, 1) != 0) {
+            return NULL;
+        }
+        if (line[k] == '\n') break;
+        if (line[k] < '0' || line[k] > '9') return NULL;
+        k++;
+    }
+    line[k] = 0;
+    size = strtoul(line, NULL, 10);
+    if (k == 0 || size > SERVER_MAX_REQUEST) {
+        return NULL;
+    }
+    payload = malloc(size + 1);
+    if (payload == NULL || read_full(fd, payload, size) != 0) {
+        free(payload);
+        return NULL;
+    }
+    payload[size] = 0;
+    return payload;
+}
+
+static int
+write_frame(int fd, const char *payload, size_t size) {
+    char line[32];
+    int k = snprintf(line, sizeof(line), "%zu\n", size);
+
+    if (write_full(fd, line, k) != 0) {
+        return -1;
+    }
+    return write_full(fd, payload, size);
+}
+
+/* Function serve_request(...) runs one fit request (see serve(...))
+   in the workspace of the calling worker and returns the response
+   payload, to be freed by the caller */
+static char *
+serve_request(char *request, struct fit_workspace *ws, size_t *size) {
+    struct fit_config cfg;
+    struct fit_result res;
+    struct fit_stats st;
+    char *argv[SERVER_MAX_ARGS], *p, *end, *save, *out = NULL;
+    int argc = 0, status;
+    size_t i;
+    FILE *stream = open_memstream(&out, size);
+
+    if (stream == NULL) {
+        return NULL;
+    }
+
+    /* The first line holds the options */
+    end = strchr(request, '\n');
+    if (end == NULL) {
+        fprintf(stream, "ERROR\nERROR: The request has no curve.\n");
+        fclose(stream);
+        return out;
+    }
+    *end = 0;
+    argv[argc++] = "cFDAP";
+    for (p = strtok_r(request, " \t\r", &save); p != NULL && argc < SERVER_MAX_ARGS;
+         p = strtok_r(NULL, " \t\r", &save)) {
+        argv[argc++] = p;
+    }
+    if (p != NULL) {
+        fprintf(stream, "ERROR\nERROR: Too many options.\n");
+        fclose(stream);
+        return out;
+    }
+    status = parse_options(argc, argv, &cfg, 1);
+    if (status) {
+        fprintf(stream, "ERROR\n%s", cfg.error);
+        fclose(stream);
+        return out;
+    }
+    if (cfg.curve_name[0] == 0) {
+        strcpy(cfg.curve_name, "request");
+    }
+
+    /* Then the curve and, for weighted fits, its standard deviations */
+    {
+        size_t n = cfg.n;
+        double *time = malloc(sizeof(double)*4*n);
+        double *y = time + n, *sigma = time + 2*n, *best_fit = time + 3*n;
+
+        if (time == NULL) {
+            fprintf(stream, "ERROR\nERROR: Out of memory.\n");
+            free(cfg.pde.profile);
+            fclose(stream);
+            return out;
         }
-        else if (p == 2) {
-            printf ("kon        = %.5f +/- %.5f\n", FIT(0), c*ERR(0));
-            printf ("kon conf   = +/- %.5f %.5f %.5f\n", c*ERR(0)*gsl_cdf_tdist_Pinv(0.95, dof), c*ERR(0)*gsl_cdf_tdist_Pinv(0.975, dof), c*ERR(0)*gsl_cdf_tdist_Pinv(0.99, dof));
-            printf ("koff       = %.5f +/- %.5f\n", FIT(1), c*ERR(1));
-            printf ("koff conf  = +/- %.5f %.5f %.5f\n", c*ERR(1)*gsl_cdf_tdist_Pinv(0.95, dof), c*ERR(1)*gsl_cdf_tdist_Pinv(0.975, dof), c*ERR(1)*gsl_cdf_tdist_Pinv(0.99, dof));
-            printf ("bound      = %.5f +/- %.5f\n", 100.0 - 100.0/(1.0 + FIT(0)/FIT(1)), 100.0*(c*ERR(0)/FIT(1) - FIT(0)*c*ERR(1)/FIT(1)/FIT(1))/(1.0 + FIT(0)/FIT(1))/(1.0 + FIT(0)/FIT(1)));
+        p = end + 1;
+        for (i = 0; i < n*(1 + cfg.w_flag); i++) {
+            double v = strtod(p, &end);
+            if (end == p) break;
+            if (i < n) y[i] = v; else sigma[i - n] = v;
+            p = end;
+        }
+        if (i < n*(1 + cfg.w_flag)) {
+            fprintf(stream, "ERROR\nERROR: The request holds %zu of %zu values.\n", i, n*(1 + cfg.w_flag));
         }
         else {
-            fprintf(stderr, "ERROR: in main: Parameter p is neither 1 nor 2.\n");
+            fit_time_grid(&cfg, time);
+            if (run_fit(&cfg, time, y, sigma, ws, &res, &st, best_fit) == GSL_ENOMEM) {
+                fprintf(stream, "ERROR\nERROR: Out of memory.\n");
+            }
+            else {
+                fprintf(stream, "OK\n");
+                print_result_csv(stream, &res, 1);
+            }
+        }
+        free(time);
+    }
+    free(cfg.pde.profile);
+    fclose(stream);
+    return out;
+}
+
+/* Worker pool of the server: the main thread watches the open
+   connections and queues those with a pending request, every worker
+   answers one request in its own warm workspace and hands the
+   connection back through the pipe "back". Idle clients thus hold no
+   worker, and a request that finds the queue full gets an ERROR */
+struct server_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    int fd[SERVER_QUEUE];
+    size_t head;
+    size_t count;
+    size_t open; /* Connections not yet closed */
+    int back;
+};
+
+static void
+server_close(struct server_queue *q, int fd) {
+    close(fd);
+    pthread_mutex_lock(&q->lock);
+    q->open--;
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void
+server_refuse(struct server_queue *q, int fd, const char *message) {
+    write_frame(fd, message, strlen(message));
+    server_close(q, fd);
+}
+
+static void *
+server_worker(void *arg) {
+    struct server_queue *q = arg;
+    struct fit_workspace ws;
+
+#ifdef _OPENMP
+    /* The workers already use all cores, nested teams would only
+       oversubscribe them */
+    omp_set_num_threads(1);
+#endif
+    workspace_init(&ws);
+    while (1) {
+        int fd;
+        char *request, *response;
+        size_t size;
+
+        pthread_mutex_lock(&q->lock);
+        while (q->count == 0) {
+            pthread_cond_wait(&q->ready, &q->lock);
+        }
+        fd = q->fd[q->head];
+        q->head = (q->head + 1) % SERVER_QUEUE;
+        q->count--;
+        pthread_mutex_unlock(&q->lock);
+
+        request = read_frame(fd);
+        if (request == NULL) {
+            server_close(q, fd);
+            continue;
+        }
+        response = serve_request(request, &ws, &size);
+        free(request);
+        if (response == NULL || write_frame(fd, response, size) != 0
+            || write_full(q->back, (const char *) &fd, sizeof(fd)) != 0) {
+            server_close(q, fd);
+        }
+        free(response);
+    }
+    return NULL;
+}
+
+static void
+server_dispatch(struct server_queue *q, int fd) {
+    pthread_mutex_lock(&q->lock);
+    if (q->count == SERVER_QUEUE) {
+        pthread_mutex_unlock(&q->lock);
+        server_refuse(q, fd, "ERROR\nERROR: The server is busy, try again later.\n");
+        return;
+    }
+    q->fd[(q->head + q->count) % SERVER_QUEUE] = fd;
+    q->count++;
+    pthread_cond_signal(&q->ready);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* Function serve(...) runs cFDAP as a fit server on the Unix domain
+   socket "path" with n_workers worker threads. Requests and
+   responses are frames: a decimal byte count, a newline and the
+   payload. A request holds the options of the fit in its first line
+   (as on the command line, starting with -m; -i only names the
+   curve, -o, -sd and -rf are ignored, plugins and -ip are refused),
+   followed by the n curve values and, for -w 1, the n standard
+   deviations, separated by white space. The response is "OK" and
+   the CSV header and row of the fit (see write_result_csv(...)), or
+   "ERROR" and a message, each followed by a newline. A connection
+   may carry any number of requests, which are answered in order. A
+   connection that stalls for SERVER_TIMEOUT seconds within a frame
+   is closed. The server runs until it is killed */
+int
+serve(const char *path, size_t n_workers) {
+    struct sockaddr_un addr;
+    struct server_queue q;
+    struct pollfd conn[SERVER_MAX_CONN + 2];
+    struct timeval timeout = { SERVER_TIMEOUT, 0 };
+    struct stat sb;
+    pthread_t thread;
+    size_t k, n_conn;
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0), back[2];
+
+    if (sock < 0 || strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "ERROR: Socket %s cannot be created.\n\n", path);
+        return 1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    /* Only a stale socket is replaced, never a file given by mistake */
+    if (lstat(path, &sb) == 0) {
+        if (!S_ISSOCK(sb.st_mode)) {
+            fprintf(stderr, "ERROR: %s exists and is not a socket.\n\n", path);
+            close(sock);
+            return 1;
+        }
+        unlink(path);
+    }
+    if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(sock, SERVER_QUEUE) != 0) {
+        fprintf(stderr, "ERROR: Socket %s cannot be bound: %s\n\n", path, strerror(errno));
+        return 1;
+    }
+    if (pipe(back) != 0) {
+        fprintf(stderr, "ERROR: Worker pipe cannot be created: %s\n\n", strerror(errno));
+        return 1;
+    }
+
+    /* A failed fit must not take the server down */
+    gsl_set_error_handler_off();
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_mutex_init(&q.lock, NULL);
+    pthread_cond_init(&q.ready, NULL);
+    q.head = 0;
+    q.count = 0;
+    q.open = 0;
+    q.back = back[1];
+    for (k = 0; k < n_workers; k++) {
+        if (pthread_create(&thread, NULL, server_worker, &q) != 0) {
+            fprintf(stderr, "ERROR: Worker threads cannot be started.\n\n");
+            return 1;
+        }
+        pthread_detach(thread);
+    }
+    fprintf(stderr, "Serving fits on %s with %zu workers.\n", path, n_workers);
+
+    /* conn[0] is the socket, conn[1] the pipe, the rest idle connections */
+    conn[0].fd = sock;
+    conn[1].fd = back[0];
+    conn[0].events = conn[1].events = POLLIN;
+    n_conn = 2;
+    while (1) {
+        if (poll(conn, n_conn, -1) < 0) {
+            if (errno != EINTR) fprintf(stderr, "ERROR: poll: %s\n", strerror(errno));
+            continue;
+        }
+
+        /* A pending request (or the end of a connection) goes to a worker */
+        for (k = 2; k < n_conn; ) {
+            if (conn[k].revents != 0) {
+                server_dispatch(&q, conn[k].fd);
+                conn[k] = conn[--n_conn];
+            }
+            else {
+                k++;
+            }
+        }
+
+        /* Answered connections wait for their next request */
+        if (conn[1].revents & POLLIN) {
+            int fd[64];
+            ssize_t r = read(back[0], fd, sizeof(fd));
+
+            for (k = 0; r > 0 && k < (size_t) r/sizeof(int); k++) {
+                conn[n_conn].fd = fd[k];
+                conn[n_conn].events = POLLIN;
+                conn[n_conn++].revents = 0;
+            }
+        }
+
+        /* New connections, as long as all open ones fit into conn */
+        if (conn[0].revents & POLLIN) {
+            int fd = accept(sock, NULL, NULL);
+
+            if (fd < 0) {
+                if (errno != EINTR) fprintf(stderr, "ERROR: accept: %s\n", strerror(errno));
+                continue;
+            }
+            pthread_mutex_lock(&q.lock);
+            q.open++;
+            k = q.open;
+            pthread_mutex_unlock(&q.lock);
+            if (k > SERVER_MAX_CONN) {
+                server_refuse(&q, fd, "ERROR\nERROR: Too many connections.\n");
+            }
+            else {
+                setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+                setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+                conn[n_conn].fd = fd;
+                conn[n_conn].events = POLLIN;
+                conn[n_conn++].revents = 0;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Function read_values(...) reads n numbers from the file "name",
+   returning 0 on success */
+static int
+read_values(const char *name, size_t n, double *v) {
+    size_t i;
+    FILE *in = fopen(name, "r");
+
+    if (in == NULL) {
+        return 1;
+    }
+    for (i = 0; i < n && fscanf(in, "%lf", &v[i]) == 1; i++);
+    fclose(in);
+    return i < n;
+}
+
+/* Function batch_seed(...) moves the starting values of the free
+   parameters to the fit of a neighbouring curve. Values a transform
+   cannot start from stay at their defaults */
+static void
+batch_seed(struct params *ps, const double *fit) {
+    size_t k;
+
+    for (k = 0; k < ps->p; k++) {
+        size_t j = ps->idx[k];
+        double v = GSL_MIN_DBL(GSL_MAX_DBL(fit[k], ps->lb[j]), ps->ub[j]);
+
+        if ((ps->tr[j] == TR_LOG && v == ps->lb[j]) || (ps->tr[j] == TR_LOG_UB && v == ps->ub[j])) {
+            continue;
+        }
+        if (ps->tr[j] == TR_LOGIT) {
+            double m = TR_MARGIN*(ps->ub[j] - ps->lb[j]);
+            v = GSL_MIN_DBL(GSL_MAX_DBL(v, ps->lb[j] + m), ps->ub[j] - m);
+        }
+        ps->value[j] = v;
+    }
+}
+
+/* Function batch_converged(...) tells whether a fit can be kept and
+   serve as a starting point */
+static int
+batch_converged(int status, const struct fit_result *res) {
+    size_t k;
+
+    if (status != GSL_SUCCESS || !gsl_finite(res->chisq_dof)) {
+        return 0;
+    }
+    for (k = 0; k < res->p; k++) {
+        if (!gsl_finite(res->fit[k])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Function run_batch(...) fits all curves of the list
+   cfg->batch_name, given as lines "curve_file [std_file]", and
+   appends the fits to the results file. Curves of one experiment
+   have similar kinetics, so they are described by the slope of the
+   early decay and the plateau (both in units of their spread within
+   the batch) and fitted in a nearest-neighbour chain through this
+   plane, starting from the most typical curve. Each fit starts from
+   the parameters of its nearest converged neighbour instead of the
+   defaults, and is repeated from the defaults if that start does
+   not converge. All fits share one workspace */
+int
+run_batch(const struct fit_config *cfg) {
+    size_t n = cfg->n, p = cfg->ps.p, m = 0, m_alloc = 16, i, j, k, r;
+    size_t n_early = GSL_MAX(1, (size_t) (BATCH_EARLY*n));
+    size_t iter_total = 0, n_warm = 0, n_failed = 0;
+    char (*curve)[2][80] = malloc(sizeof(*curve)*m_alloc);
+    char line[512];
+    double time[n], best_fit[n], mean[2] = { 0.0, 0.0 }, sd[2] = { 0.0, 0.0 };
+    double *y = NULL, *sigma = NULL, *feat = NULL, *fit = NULL;
+    size_t *order = NULL;
+    int *done = NULL, *good = NULL, status = 1;
+    struct fit_workspace ws;
+    FILE *list = fopen(cfg->batch_name, "r");
+
+#define DIST(a, b) (pow((feat[2*(a)] - feat[2*(b)])/sd[0], 2.0) + \
+                    pow((feat[2*(a) + 1] - feat[2*(b) + 1])/sd[1], 2.0))
+
+    if (list == NULL) {
+        fprintf(stderr, "ERROR: The list of curves cannot be opened.\n");
+        free(curve);
+        return 1;
+    }
+    if (curve == NULL) {
+        fprintf(stderr, "ERROR: in 'run_batch': Out of memory.\n");
+        fclose(list);
+        return 1;
+    }
+    while (fgets(line, sizeof(line), list) != NULL) {
+        int found = sscanf(line, "%79s %79s", curve[m][0], curve[m][1]);
+        if (found < 1) {
+            continue;
+        }
+        if (found < 2) {
+            if (cfg->w_flag == 1) {
+                fprintf(stderr, "ERROR: %s has no SD file in the list of curves.\n", curve[m][0]);
+                fclose(list);
+                goto done;
+            }
+            curve[m][1][0] = 0;
+        }
+        if (++m == m_alloc) {
+            char (*more)[2][80] = realloc(curve, sizeof(*curve)*2*m_alloc);
+            if (more == NULL) {
+                fprintf(stderr, "ERROR: in 'run_batch': Out of memory.\n");
+                fclose(list);
+                goto done;
+            }
+            curve = more;
+            m_alloc *= 2;
+        }
+    }
+    fclose(list);
+    if (m == 0) {
+        fprintf(stderr, "ERROR: The list of curves is empty.\n");
+        goto done;
+    }
+
+    y = malloc(sizeof(double)*n*m);
+    if (cfg->w_flag == 1) {
+        sigma = malloc(sizeof(double)*n*m);
+    }
+    feat = malloc(sizeof(double)*2*m);
+    fit = malloc(sizeof(double)*p*m);
+    order = malloc(sizeof(size_t)*m);
+    done = calloc(m, sizeof(int));
+    good = calloc(m, sizeof(int));
+    if (y == NULL || (cfg->w_flag == 1 && sigma == NULL) || feat == NULL || fit == NULL ||
+        order == NULL || done == NULL || good == NULL) {
+        fprintf(stderr, "ERROR: in 'run_batch': Out of memory.\n");
+        goto done;
+    }
+    fit_time_grid(cfg, time);
+
+    /* Reading the curves, their early slope and their plateau */
+    for (i = 0; i < m; i++) {
+        double *yi = y + i*n, plateau = 0.0;
+        if (read_values(curve[i][0], n, yi) != 0 ||
+            (sigma != NULL && read_values(curve[i][1], n, sigma + i*n) != 0)) {
+            fprintf(stderr, "ERROR: The files of curve %s cannot be read.\n", curve[i][0]);
+            goto done;
+        }
+        for (j = n - n_early; j < n; j++) {
+            plateau += yi[j];
+        }
+        feat[2*i] = (yi[0] - yi[n_early])/(time[n_early] - time[0]);
+        feat[2*i + 1] = plateau/(double) n_early;
+        for (k = 0; k < 2; k++) {
+            mean[k] += feat[2*i + k]/(double) m;
+        }
+    }
+    for (k = 0; k < 2; k++) {
+        for (i = 0; i < m; i++) {
+            sd[k] += pow(feat[2*i + k] - mean[k], 2.0)/(double) m;
+        }
+        sd[k] = (sd[k] > 0.0) ? sqrt(sd[k]) : 1.0;
+    }
+
+    /* Chaining the curves, starting from the one closest to the mean */
+    for (r = 0; r < m; r++) {
+        double d_min = GSL_POSINF;
+        size_t next = 0;
+        for (i = 0; i < m; i++) {
+            double d;
+            if (done[i]) {
+                continue;
+            }
+            if (r == 0) {
+                d = pow((feat[2*i] - mean[0])/sd[0], 2.0) + pow((feat[2*i + 1] - mean[1])/sd[1], 2.0);
+            }
+            else {
+                d = DIST(order[r - 1], i);
+            }
+            if (d < d_min) {
+                d_min = d;
+                next = i;
+            }
+        }
+        order[r] = next;
+        done[next] = 1;
+    }
+
+    workspace_init(&ws);
+    for (r = 0; r < m; r++) {
+        struct fit_config c = *cfg;
+        struct fit_result res;
+        struct fit_stats st;
+        size_t iter, seed = m;
+        double d_min = GSL_POSINF;
+        int fit_status, fallback = 0;
+
+        i = order[r];
+        snprintf(c.curve_name, sizeof(c.curve_name), "%s", curve[i][0]);
+        for (j = 0; j < m; j++) {
+            if (good[j] && DIST(i, j) < d_min) {
+                d_min = DIST(i, j);
+                seed = j;
+            }
+        }
+        if (seed < m) {
+            batch_seed(&c.ps, fit + seed*p);
+            n_warm++;
+        }
+
+        fit_status = run_fit(&c, time, y + i*n, (sigma != NULL) ? sigma + i*n : NULL,
+                             &ws, &res, &st, best_fit);
+        if (fit_status == GSL_ENOMEM) {
+            fprintf(stderr, "ERROR: Out of memory.\n");
+            workspace_free(&ws);
+            goto done;
+        }
+        iter = res.iter;
+        if (seed < m && !batch_converged(fit_status, &res)) {
+            /* Falling back to the defaults */
+            c.ps = cfg->ps;
+            fit_status = run_fit(&c, time, y + i*n, (sigma != NULL) ? sigma + i*n : NULL,
+                                 &ws, &res, &st, best_fit);
+            if (fit_status == GSL_ENOMEM) {
+                fprintf(stderr, "ERROR: Out of memory.\n");
+                workspace_free(&ws);
+                goto done;
+            }
+            iter += res.iter;
+            fallback = 1;
+            n_failed++;
+        }
+        if (batch_converged(fit_status, &res)) {
+            good[i] = 1;
+            memcpy(fit + i*p, res.fit, sizeof(double)*p);
+        }
+        iter_total += iter;
+
+        if ((cfg->results_bin ? write_result_bin(cfg->results_name, &res)
+                              : write_result_csv(cfg->results_name, &res)) != GSL_SUCCESS) {
+            workspace_free(&ws);
+            goto done;
+        }
+        if (cfg->quiet < 2) {
+            printf("%-30s %5zu iterations, started from %s%s\n", curve[i][0], iter,
+                   (seed < m) ? curve[seed][0] : "the defaults",
+                   fallback ? ", refitted from the defaults" : "");
+        }
+    }
+    workspace_free(&ws);
+
+    printf("\nBatch of %zu curves: %zu iterations, %zu warm starts, %zu of them failed\n",
+           m, iter_total, n_warm, n_failed);
+    status = 0;
+
+#undef DIST
+
+done:
+    free(curve);
+    free(y);
+    free(sigma);
+    free(feat);
+    free(fit);
+    free(order);
+    free(done);
+    free(good);
+    return status;
+}
+
+/* MAIN */
+int
+main(int argc, char *argv[]) {
+
+    int status;
+    size_t i, k;
+    struct fit_config cfg;
+    struct fit_result res;
+    struct fit_stats st;
+    struct fit_workspace ws;
+
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  --------------   cFDAP 0.1.0 (C) 2015\n");
+    fprintf(stderr, "  |*    cFDAP  |   Author: Maxim Igaev\n");
+    fprintf(stderr, "  | *          |   cFDAP is a fitting program for FDAP data\n");
+    fprintf(stderr, "  |  ***       |   http://www.neurobiologie.uni-osnabrueck.de/\n");
+    fprintf(stderr, "  |     *******|   https://github.com/moozzz\n");
+    fprintf(stderr, "  --------------   Email: max_igaev@yahoo.com\n");
+    fprintf(stderr, "\n");
+
+    if ((argc < 2) || (argc > 56)) {
+        bad_input();
+    }
+
+    /* Server mode */
+    if (strcmp(argv[1], "-server") == 0) {
+        long n_workers = sysconf(_SC_NPROCESSORS_ONLN);
+        if (argc != 3 && !(argc == 5 && strcmp(argv[3], "-threads") == 0)) {
+            fprintf(stderr, "ERROR: Usage: cFDAP -server socket_path [-threads n].\n\n");
+            exit(1);
+        }
+        if (argc == 5) {
+            n_workers = atol(argv[4]);
+        }
+        if (n_workers < 1) {
+            fprintf(stderr, "ERROR: Would a server without workers make sense?\n\n");
             exit(1);
         }
+        return serve(argv[2], n_workers);
+    }
 
-        /* Writing the fit parameters */
-        FILE *fit_params = fopen(strcat(output_prefix, "_fit_params.dat"), "w");
-        if (p == 1) {
-            fprintf(fit_params, "chisq/dof %g\n", pow(chi, 2.0) / dof);
-            fprintf(fit_params, "x_fit %.5f\n", FIT(0));
-            fprintf(fit_params, "x_error %.5f\n", c*ERR(0));
-            fprintf(fit_params, "x_conf_int %.5f %.5f %.5f\n", c*ERR(0)*gsl_cdf_tdist_Pinv(0.95, dof), c*ERR(0)*gsl_cdf_tdist_Pinv(0.975, dof), c*ERR(0)*gsl_cdf_tdist_Pinv(0.99, dof));
-            fprintf(fit_params, "bound %.5f\n", 100.0 - 100.0/(1.0 + FIT(0)));
-        }
-        else if (p == 2) {
-            fprintf(fit_params, "chisq/dof %g\n", pow(chi, 2.0) / dof);
-            fprintf(fit_params, "kon_fit %.5f\n", FIT(0));
-            fprintf(fit_params, "kon_error %.5f\n", c*ERR(0));
-            fprintf(fit_params, "kon_conf_int %.5f %.5f %.5f\n", c*ERR(0)*gsl_cdf_tdist_Pinv(0.95, dof), c*ERR(0)*gsl_cdf_tdist_Pinv(0.975, dof), c*ERR(0)*gsl_cdf_tdist_Pinv(0.99, dof));
-            fprintf(fit_params, "koff_fit %.5f\n", FIT(1));
-            fprintf(fit_params, "koff_error %.5f\n", c*ERR(1));
-            fprintf(fit_params, "koff_conf_int %.5f %.5f %.5f\n", c*ERR(1)*gsl_cdf_tdist_Pinv(0.95, dof), c*ERR(1)*gsl_cdf_tdist_Pinv(0.975, dof), c*ERR(1)*gsl_cdf_tdist_Pinv(0.99, dof));
-            fprintf(fit_params, "bound %.5f\n", 100.0 - 100.0/(1.0 + FIT(0)/FIT(1)));
-            fprintf(fit_params, "bound_error %.5f\n", 100.0*(c*ERR(0)/FIT(1) - FIT(0)*c*ERR(1)/FIT(1)/FIT(1))/(1.0 + FIT(0)/FIT(1))/(1.0 + FIT(0)/FIT(1)));
+    status = parse_options(argc, argv, &cfg, 0);
+    if (status) {
+        fprintf(stderr, "%s", cfg.error);
+        if (status == 2) bad_input();
+        exit(1);
+    }
+
+    /* Batch mode */
+    if (cfg.batch_name[0] != 0) {
+        status = run_batch(&cfg);
+        free(cfg.pde.profile);
+        return status;
+    }
+
+    size_t n = cfg.n, p = cfg.ps.p;
+    double time[n], y[n], sigma[n], best_fit[n];
+    char output_prefix_copy[80];
+    strcpy(output_prefix_copy, cfg.output_prefix);
+
+    /* Importing the FDAP curve to be fitted */
+    double temp;
+    FILE *input_curve = fopen(cfg.curve_name, "r");
+    printf("Opening the curve file...\n");
+    if(input_curve == NULL) {
+        fprintf(stderr, "ERROR: input_curve file cannot be opened.\n");
+        fprintf(stderr, "ERROR: Probably, cFDAP and input_curve must be in the same folder.\n");
+        exit(1);
+    }
+    fit_time_grid(&cfg, time);
+    for(i = 0; i < NELEMS_1D(y); i++) {
+        fscanf(input_curve, "%lf", &temp);
+        y[i] = temp;
+        if (i < 5 && !cfg.quiet) printf("data: %f %g\n", time[i], y[i]);
+    }
+    printf("Curve file has been successfully read in.\n\n");
+    fclose(input_curve);
+
+    /* Importing the errors for the FDAP curve if w_flag == 1 */
+    if (cfg.w_flag == 1) {
+        FILE *error_curve = fopen(cfg.std_name, "r");
+        printf("Opening the error file...\n");
+        if(error_curve == NULL) {
+            fprintf(stderr, "ERROR: error_curve file cannot be opened.\n");
+            fprintf(stderr, "ERROR: Probably, cFDAP and error_curve must be in the same folder.\n");
+            exit(1);
         }
-        else {
-            fprintf(stderr, "ERROR: in main: Parameter p is neither 1 nor 2.\n");
+        for(i = 0; i < NELEMS_1D(y); i++) {
+            fscanf(error_curve, "%lf", &temp);
+            sigma[i] = temp;
+            if (i < 5 && !cfg.quiet) printf("data: %g\n", sigma[i]);
+        }
+        printf("Error file has been successfully read in.\n\n");
+        fclose(error_curve);
+    }
+
+    /* Fitting */
+    workspace_init(&ws);
+    status = run_fit(&cfg, time, y, sigma, &ws, &res, &st,
+                     (cfg.output_prefix[0] != 0 || cfg.with_curves) ? best_fit : NULL);
+    if (status == GSL_ENOMEM) {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        exit(1);
+    }
+
+    printf("\nSummary from method '%s':\n", st.method);
+    printf("Number of iterations done: %zu\n", res.iter);
+    if (cfg.continuation) {
+        printf("Iterations per precision level:");
+        for (k = 0; k < N_PRECISION; k++) {
+            printf(" %zu", st.iter_level[k]);
+        }
+        printf("\n");
+    }
+    printf("Function evaluations: %zu\n", st.nevalf);
+    printf("Jacobian evaluations: %zu\n", st.nevaldf);
+    printf("Cache hits/misses: curves %zu/%zu, Jacobians %zu/%zu\n",
+           st.hits_f, st.misses_f, st.hits_df, st.misses_df);
+    printf("Wall time: %.3f s\n", st.wall);
+    printf("Initial |f(x)| = %g\n", st.chi0);
+    printf("Final |f(x)| = %g\n", st.chi);
+    printf("chisq/dof = %g\n", res.chisq_dof);
+    for (k = 0; k < p; k++) {
+        char label[32];
+        printf ("%-10s = %.5f +/- %.5f\n", res.names[k], res.fit[k], res.err[k]);
+        snprintf(label, sizeof(label), "%s conf", res.names[k]);
+        printf ("%-10s = +/- %.5f %.5f %.5f\n", label, res.conf[k][0], res.conf[k][1], res.conf[k][2]);
+    }
+    printf ("bound      = %.5f +/- %.5f\n", res.bound, res.bound_err);
+
+    /* Comparing the decimated fit with a fit of all time points */
+    if (cfg.dec_check) {
+        struct fit_config full_cfg = cfg;
+        struct fit_result ref;
+        struct fit_stats ref_st;
+
+        full_cfg.dec = DEC_NONE;
+        full_cfg.quiet = 2;
+        if (run_fit(&full_cfg, time, y, sigma, &ws, &ref, &ref_st, NULL) == GSL_ENOMEM) {
+            fprintf(stderr, "ERROR: Out of memory.\n");
             exit(1);
         }
-        fclose(fit_params);
+        printf("\nFull fit of all %zu time points:\n", n);
+        printf("Number of iterations done: %zu\n", ref.iter);
+        printf("Wall time: %.3f s (decimated fit %.1f times faster)\n", ref_st.wall, ref_st.wall/st.wall);
+        for (k = 0; k < p; k++) {
+            double dev = res.fit[k] - ref.fit[k];
+            printf ("%-10s = %.5f +/- %.5f, deviation %.5f (%.3f errors)\n",
+                    ref.names[k], ref.fit[k], ref.err[k], dev, dev/ref.err[k]);
+        }
+        printf ("bound      = %.5f, deviation %.5f\n", ref.bound, res.bound - ref.bound);
     }
 
     printf ("\nSTATUS = %s\n\n", gsl_strerror (status));
 
-    /* Writing the best fit */
-    FILE *fit_curve = fopen(strcat(output_prefix_copy, "_best_fit.dat"), "w");
-    if (p == 1) {
-        for(i = 0; i < NELEMS_1D(best_fit); i++) {
-            fprintf(fit_curve, "%f\n", invlap_1(time[i], FIT(0), Df, R, m, 0));
+    if (cfg.output_prefix[0] != 0) {
+        /* Writing the fit parameters */
+        FILE *fit_params = fopen(strcat(cfg.output_prefix, "_fit_params.dat"), "w");
+        fprintf(fit_params, "chisq/dof %g\n", res.chisq_dof);
+        for (k = 0; k < p; k++) {
+            fprintf(fit_params, "%s_fit %.5f\n", res.names[k], res.fit[k]);
+            fprintf(fit_params, "%s_error %.5f\n", res.names[k], res.err[k]);
+            fprintf(fit_params, "%s_conf_int %.5f %.5f %.5f\n", res.names[k], res.conf[k][0], res.conf[k][1], res.conf[k][2]);
         }
-    }
-    else if (p == 2) {
+        fprintf(fit_params, "bound %.5f\n", res.bound);
+        if (param_index(&cfg.ps, "x") < 0) {
+            fprintf(fit_params, "bound_error %.5f\n", res.bound_err);
+        }
+        fclose(fit_params);
+
+        /* Writing the best fit */
+        FILE *fit_curve = fopen(strcat(output_prefix_copy, "_best_fit.dat"), "w");
         for(i = 0; i < NELEMS_1D(best_fit); i++) {
-            fprintf(fit_curve, "%f\n", invlap_2(time[i], FIT(0), FIT(1), Df, R, m, 0));
+            fprintf(fit_curve, "%f\n", best_fit[i]);
         }
+        fclose(fit_curve);
     }
-    else {
-        fprintf(stderr, "ERROR: in main: Parameter p is neither 1 nor 2.\n");
-        exit(1);
+
+    /* Appending the fit to the results file */
+    status = 0;
+    if (cfg.results_name[0] != 0) {
+        if (cfg.results_bin) {
+            status = write_result_bin(cfg.results_name, &res);
+        }
+        else {
+            status = write_result_csv(cfg.results_name, &res);
+        }
     }
-    fclose(fit_curve);
 
-    gsl_multifit_fdfsolver_free (s);
-    gsl_matrix_free (covar);
-    gsl_matrix_free (J);
+    workspace_free(&ws);
+    free(cfg.pde.profile);
 
-    return 0;
+    return (status == GSL_SUCCESS) ? 0 : 1;
 }
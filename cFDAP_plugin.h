@@ -0,0 +1,67 @@
+/*******************************************/
+/* cFDAP_plugin.h                          */
+/*******************************************/
+
+/* Interface of runtime-loadable cFDAP models. A plugin is a shared
+   object that exports one descriptor named "cfdap_plugin":
+
+       #include "cFDAP_plugin.h"
+
+       static int my_eval(size_t m, const double complex *s,
+                          const double *par, double complex *F,
+                          double complex *dF) { ... }
+
+       const struct cfdap_plugin cfdap_plugin = {
+           CFDAP_PLUGIN_ABI, "myModel", 2, { "kon", "koff" },
+           { 0.5, 0.5 }, 1, my_eval
+       };
+
+   compiled with
+
+       cc -shared -fPIC my_model.c -o my_model.so -lm
+
+   and selected with "cFDAP -m ./my_model.so ...". The model is
+   given by its Laplace image F(s); cFDAP adds the immobile fraction
+   and does the inversion and the fit. */
+
+#ifndef CFDAP_PLUGIN_H
+#define CFDAP_PLUGIN_H
+
+#include <stddef.h>
+#include <complex.h>
+
+/* Bumped whenever struct cfdap_plugin or the meaning of eval changes */
+#define CFDAP_PLUGIN_ABI 1
+
+/* Kinetic parameters a plugin may have, besides Df and R */
+#define CFDAP_PLUGIN_MAX_KIN 4
+
+struct cfdap_plugin {
+    int abi; /* CFDAP_PLUGIN_ABI */
+    const char * name;
+    size_t n_kin; /* Number of kinetic parameters */
+    const char * kin_name[CFDAP_PLUGIN_MAX_KIN];
+    double kin_init[CFDAP_PLUGIN_MAX_KIN]; /* Default starting values */
+    int gradients; /* 1 - eval fills dF, 0 - cFDAP uses finite differences */
+
+    /* Evaluates the Laplace image at m nodes s[0..m-1] for
+       par = { kinetic parameters..., Df, R }:
+
+           F[i] = F(s[i])
+           dF[j*m + i] = dF/dpar[j](s[i]), j = 0..n_kin + 1
+
+       dF is NULL when no gradients are needed (and always for
+       gradients = 0). For every parameter set, cFDAP evaluates all
+       nodes of the inversion, split into up to 16 consecutive
+       slices (PLUGIN_CHUNKS in cFDAP.c), so eval is called up to 16
+       times with m about 1/16 of the nodes (never 0). With OpenMP,
+       these calls run in several threads at once, so eval must not
+       keep state between calls. With
+       gradients = 0, every fitted parameter costs two more such
+       rounds at shifted parameters (central differences). Returns 0
+       on success, anything else aborts the evaluation. */
+    int (*eval)(size_t m, const double complex *s, const double *par,
+                double complex *F, double complex *dF);
+};
+
+#endif
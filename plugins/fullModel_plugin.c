@@ -0,0 +1,68 @@
+/*******************************************/
+/* fullModel_plugin.c                      */
+/*******************************************/
+
+/* Example model plugin for cFDAP. It implements the same F(s) as the
+   built-in fullModel, so both can be compared on the same curve (the
+   built-in model adds the unit step 1/s analytically and is
+   therefore slightly more accurate at early times):
+
+       cc -shared -fPIC -I.. fullModel_plugin.c -o fullModel_plugin.so -lm
+       cFDAP -m ./fullModel_plugin.so -i tau441wt.dat -o tau441wt
+
+   The Laplace image is
+
+       F(s) = A(s)*G(s, q) + B/(s + koff)
+
+   with u = 1 + kon/(s + koff), A = u*koff/(kon + koff),
+   B = kon/(kon + koff), q = R*sqrt(s*u/Df) and
+   G = 1/s - (1 - exp(-2q))/(2sq). All terms that F and its
+   gradient share are computed only once per node. */
+
+#include <math.h>
+#include <complex.h>
+#include "cFDAP_plugin.h"
+
+static int
+fullModel_eval(size_t m, const double complex *s, const double *par,
+               double complex *F, double complex *dF) {
+    /* par = { kon, koff, Df, R } */
+    double kon = par[0], koff = par[1], Df = par[2], R = par[3];
+    double B = kon/(kon + koff), kk = (kon + koff)*(kon + koff);
+    size_t i;
+
+    for (i = 0; i < m; i++) {
+        double complex si = s[i], sk = si + koff;
+        double complex u = 1.0 + kon/sk;
+        double complex A = u*koff/(kon + koff);
+        double complex q = R*csqrt(si*u/Df), e = cexp(-2.0*q);
+        double complex G = 1.0/si - (1.0 - e)/(2.0*si*q);
+        double complex g = (1.0 - (1.0 + 2.0*q)*e)/(4.0*si*q); /* q/2*dG/dq */
+        double complex du_dkoff = -kon/(sk*sk);
+
+        F[i] = A*G + B/sk;
+        if (dF == NULL) {
+            continue;
+        }
+        /* d/dkon */
+        dF[i] = (koff/((kon + koff)*sk) - u*koff/kk)*G + A*g/(u*sk) + koff/kk/sk;
+        /* d/dkoff */
+        dF[m + i] = (du_dkoff*koff/(kon + koff) + u*kon/kk)*G + A*g*du_dkoff/u
+                    - kon/kk/sk - B/(sk*sk);
+        /* d/dDf */
+        dF[2*m + i] = -A*g/Df;
+        /* d/dR */
+        dF[3*m + i] = 2.0*A*g/R;
+    }
+    return 0;
+}
+
+const struct cfdap_plugin cfdap_plugin = {
+    CFDAP_PLUGIN_ABI,
+    "fullModelPlugin",
+    2,
+    { "kon", "koff" },
+    { 0.5, 0.5 },
+    1,
+    fullModel_eval
+};